@@ -1,30 +1,429 @@
 #ifndef MEDIADBGFS_H_
 #define MEDIADBGFS_H_
 
+/* The log records are written asynchronously, see dmxfs_log.c. The levels
+ * above DMXFS_LOG_LEVEL_MAX are compiled out, the rest are checked against
+ * the level of the category before formatting anything
+ */
+typedef enum _LogCategory
+{
+	LOG_FUSE,
+	LOG_DB,
+	LOG_SCAN,
+	LOG_GST,
+	LOG_CATEGORIES,
+} LogCategory;
+
+typedef enum _LogLevel
+{
+	LOG_LEVEL_ERROR,
+	LOG_LEVEL_WARNING,
+	LOG_LEVEL_INFO,
+	LOG_LEVEL_DEBUG,
+} LogLevel;
+
+#ifndef DMXFS_LOG_LEVEL_MAX
+#define DMXFS_LOG_LEVEL_MAX LOG_LEVEL_DEBUG
+#endif
+
+extern LogLevel log_levels[LOG_CATEGORIES];
+
+#define DMXFS_LOG(cat, level, ...) do { \
+	if ((level) <= DMXFS_LOG_LEVEL_MAX && (level) <= log_levels[cat]) \
+		log_print(cat, level, __VA_ARGS__); \
+} while (0)
+#define DMXFS_ERR(cat, ...) DMXFS_LOG(cat, LOG_LEVEL_ERROR, __VA_ARGS__)
+#define DMXFS_WARN(cat, ...) DMXFS_LOG(cat, LOG_LEVEL_WARNING, __VA_ARGS__)
+#define DMXFS_INFO(cat, ...) DMXFS_LOG(cat, LOG_LEVEL_INFO, __VA_ARGS__)
+#define DMXFS_DBG(cat, ...) DMXFS_LOG(cat, LOG_LEVEL_DEBUG, __VA_ARGS__)
+
+void log_print(LogCategory category, LogLevel level, const char *fmt, ...)
+		__attribute__((format(printf, 3, 4)));
+int log_config(const char *spec);
+const char * log_category_name(LogCategory category);
+int log_init(void);
+void log_shutdown(void);
+
+/* Latency histograms, see dmxfs_metrics.c. Every FUSE operation, database
+ * helper and scanner stage has its own one
+ */
+typedef enum _Metric
+{
+	METRIC_FUSE_LOOKUP,
+	METRIC_FUSE_GETATTR,
+	METRIC_FUSE_READLINK,
+	METRIC_FUSE_OPEN,
+	METRIC_FUSE_READ,
+	METRIC_FUSE_OPENDIR,
+	METRIC_FUSE_READDIR,
+	METRIC_FUSE_READDIRPLUS,
+	METRIC_FUSE_GETXATTR,
+	METRIC_FUSE_LISTXATTR,
+	METRIC_FUSE_STATFS,
+	METRIC_DB_FILE_GET_FROM_ID,
+	METRIC_DB_FILE_GET_FROM_NAME,
+	METRIC_DB_FILE_GET_FROM_IDS,
+	METRIC_DB_FILE_GET_FROM_CAPS,
+	METRIC_DB_FILE_GET_IDS_FROM_CAPS,
+	METRIC_DB_FILE_SET_MEDIA_INFO,
+	METRIC_DB_FILE_COUNTERS_LOAD,
+	METRIC_DB_CAP_NEW_FROM_NAME,
+	METRIC_DB_CAP_GET_DIFFERENT_FROM_CAPS,
+	METRIC_DB_CAP_GET_FROM_FILE,
+	METRIC_DB_CAP_COUNTERS_LOAD,
+	METRIC_DB_CAP_DESTROY,
+	METRIC_DB_INSERT_FILE,
+	METRIC_DB_INSERT_FILECAP,
+	METRIC_DB_DELETE_FILECAPS,
+	METRIC_DB_FILE_CHANGED,
+	METRIC_SCAN_CHECK,
+	METRIC_SCAN_PROBE,
+	METRIC_SCAN_CAPS,
+	METRICS,
+} Metric;
+
+uint64_t metrics_now(void);
+void metrics_span(Metric m, uint64_t start, uint64_t end);
+void metrics_observe(Metric m, uint64_t start);
+void metrics_print(GString *s);
+void metrics_shutdown(void);
+
+/* Spans of the timeline, see dmxfs_trace.c. They share the categories of
+ * the log and nothing is recorded until trace_init()
+ */
+extern int trace_enabled;
+
+int trace_init(unsigned int events);
+uint64_t trace_begin(void);
+void trace_end(LogCategory category, const char *name, uint64_t start);
+void trace_span(LogCategory category, const char *name, uint64_t start,
+		uint64_t end);
+char * trace_dump(void);
+int trace_write(const char *path);
+void trace_shutdown(void);
+
+/* the result of a listing, a refcounted array of ids */
+typedef struct _CacheResult CacheResult;
+
+/* allocations released all at once, see dmxfs_arena.c */
+typedef struct _ArenaChunk ArenaChunk;
+
+typedef struct _Arena
+{
+	ArenaChunk *chunks;
+	size_t chunk_size;
+} Arena;
+
+Arena * arena_new(size_t chunk_size);
+void * arena_alloc(Arena *arena, size_t size);
+char * arena_strdup(Arena *arena, const char *str);
+void arena_free(Arena *arena);
+
 typedef struct _Cap
 {
 	unsigned int id;
 	char *name;
+	unsigned int files; /* number of files that have this cap */
 } Cap;
 
+/* caps are interned, the ones returned by the functions below are owned
+ * by the caps dictionary and must not be freed
+ */
+typedef struct _QueryTerm
+{
+	int negate; /* the files must have none of the caps */
+	GList *caps; /* the files must have any of them, sorted by id */
+} QueryTerm;
+
+/* the conjunction of every term, immutable once parsed */
+typedef struct _Query
+{
+	int ref;
+	GList *terms;
+} Query;
+
 void cap_free(Cap *cap);
-void cap_destroy(Cap *cap, sqlite3 *db);
+int cap_destroy(Cap *cap, sqlite3 *db);
 Cap * cap_new_from_name(sqlite3 *db, const char *name);
-Cap * cap_get_from_name(sqlite3 *db, const char *name);
+Cap * cap_get_from_name(const char *name);
+Cap * cap_get_from_id(unsigned int id);
 GList * cap_get_relative(GList *caps);
+GList * cap_get_from_file(sqlite3 *db, unsigned int file_id);
+unsigned int cap_count(void);
+int cap_counters_load(sqlite3 *db);
+void cap_counters_add(GList *caps, int delta);
 int cap_init(sqlite3 *db);
-GList * cap_get_different_from_caps(sqlite3 *db, GList *caps);
+void cap_shutdown(void);
+CacheResult * cap_get_different_from_caps(sqlite3 *db, GList *caps, Query *query);
+
+int query_is_expression(const char *name);
+Query * query_parse(const char *expr, Query *parent);
+Query * query_ref(Query *q);
+void query_unref(Query *q);
+int query_match(Query *q, GList *caps);
+char * query_key(Query *q);
+char * query_to_sql(Query *q, GList *caps);
 
 typedef struct _File
 {
 	unsigned int id;
 	char *name;
 	time_t modtime;
+	off_t size;
+	/* stream information, zero when unknown */
+	unsigned int duration; /* in milliseconds */
+	unsigned int bitrate; /* in bits per second */
+	unsigned int width;
+	unsigned int height;
 } File;
 
+/* A page of files, the files are contiguous and their names live on the
+ * arena, everything is released with file_set_free()
+ */
+typedef struct _FileSet
+{
+	unsigned int count;
+	unsigned int size;
+	File *files;
+	Arena *arena;
+} FileSet;
+
+void file_set_free(FileSet *set);
+
 File * file_get_from_id(sqlite3 *db, unsigned int id);
+FileSet * file_get_from_ids(sqlite3 *db, const unsigned int *ids, int count);
+int file_set_media_info(sqlite3 *db, unsigned int id, unsigned int duration,
+		unsigned int bitrate, unsigned int width, unsigned int height);
 File * file_get_from_name(sqlite3 *db, const char *name);
-GList * file_get_from_caps(sqlite3 *db, GList *caps, int limit, int offset);
+FileSet * file_get_from_caps(sqlite3 *db, GList *caps, Query *query,
+		unsigned int after, unsigned int before, int limit);
+CacheResult * file_get_ids_from_caps(sqlite3 *db, GList *caps, Query *query,
+		unsigned int after, unsigned int before, int limit);
 void file_free(File *file);
+int file_counters_load(sqlite3 *db);
+void file_counters_get(unsigned int *files, uint64_t *bytes);
+unsigned int file_last_get(void);
+void file_roots_hide(sqlite3 *db, const unsigned int *ids, unsigned int count);
+const char * file_roots_hidden(void);
+
+typedef enum _CacheKind
+{
+	CACHE_SUBCAPS,
+	CACHE_FILES,
+	CACHE_BUCKETS,
+} CacheKind;
+
+struct _CacheResult
+{
+	int ref;
+	unsigned int count;
+	unsigned int size; /* number of ids allocated */
+	unsigned int ids[];
+};
+
+CacheResult * cache_result_new(unsigned int count);
+CacheResult * cache_result_append(CacheResult *r, unsigned int id);
+CacheResult * cache_result_ref(CacheResult *r);
+void cache_result_unref(CacheResult *r);
+CacheResult * cache_get(GList *caps, Query *query, CacheKind kind);
+void cache_set(GList *caps, Query *query, CacheKind kind, CacheResult *r,
+		unsigned int generation);
+int cache_init(unsigned int size);
+void cache_shutdown(void);
+
+/* Inode numbers, the root directory is always 1, the rest of directories
+ * get a new number on their first lookup, files are their id plus the
+ * NODE_INO_FILE bit and the files of the control directory their index
+ * plus the NODE_INO_CONTROL bit
+ */
+#define NODE_INO_ROOT 1
+#define NODE_INO_FILE ((uint64_t)1 << 62)
+#define NODE_INO_CONTROL ((uint64_t)1 << 61)
+#define node_ino_is_file(ino) (((ino) & NODE_INO_FILE) != 0)
+#define node_ino_from_file(id) (NODE_INO_FILE | (uint64_t)(id))
+#define node_ino_to_file(ino) ((unsigned int)((ino) & ~NODE_INO_FILE))
+#define node_ino_is_control(ino) (((ino) & NODE_INO_CONTROL) != 0)
+#define node_ino_from_control(idx) (NODE_INO_CONTROL | (uint64_t)(idx))
+#define node_ino_to_control(ino) ((unsigned int)((ino) & ~NODE_INO_CONTROL))
+
+typedef enum _NodeType
+{
+	NODE_CAPS, /* lists the files directory and the related caps */
+	NODE_FILES, /* lists the files that have every cap */
+	NODE_BUCKET, /* lists the files of a files directory on an id range */
+	NODE_CONTROL, /* lists the control files, see dmxfs.c */
+} NodeType;
+
+typedef struct _Node
+{
+	uint64_t ino;
+	NodeType type;
+	struct _Node *parent;
+	Cap *cap; /* the cap this node adds to its parent caps */
+	char *name;
+	GList *caps; /* the caps from the root down to this node */
+	Query *query; /* the query expressions on the path, if any */
+	GHashTable *children;
+	uint64_t nlookup;
+} Node;
+
+Node * node_get(uint64_t ino);
+Node * node_child_ref(Node *parent, NodeType type, Cap *cap, Query *query,
+		const char *name);
+uint64_t node_child_ino(Node *parent, const char *name);
+void node_forget(uint64_t ino, uint64_t nlookup);
+int node_bucket_range(const char *name, unsigned int *first,
+		unsigned int *last);
+typedef void (*NodeInvalidateCb)(uint64_t ino, const char *name, void *data);
+void node_invalidate(GList *caps, unsigned int file_id, NodeInvalidateCb cb,
+		void *data);
+int node_init(void);
+void node_shutdown(void);
+
+unsigned int index_generation_get(void);
+void index_generation_bump(void);
+
+/* The kernel keeps the entries and attributes as long as it wants, the
+ * index only changes when the scanner says so
+ */
+#define DMXFS_ENTRY_TIMEOUT 86400.0
+#define DMXFS_ATTR_TIMEOUT 86400.0
+/* number of readdir results to keep around */
+#define DMXFS_CACHE_SIZE 256
+/* bigger files listings are not cached but streamed from the database */
+#define DMXFS_CACHE_MAX_FILES 65536
+
+/* where the scanner spends its time, in nanoseconds */
+typedef struct _dmxfs_scan_stats
+{
+	unsigned int dirs;
+	unsigned int files;
+	/* the files whose type was looked for, the rest did not change */
+	unsigned int probed;
+	unsigned int media;
+	/* reading the directories and stating the files */
+	uint64_t walk;
+	/* looking for the file on the database */
+	uint64_t check;
+	/* finding the type of the file */
+	uint64_t probe;
+	/* decoding the streams of a media file */
+	uint64_t caps;
+	/* the files not found anymore, removed once the scan is over */
+	unsigned int removed;
+} dmxfs_scan_stats;
+
+/* The state shared by dmxfs, dmxfs-index and the benchmarks, the
+ * database is set up by dmxfs_db.c and written by dmxfs_scan.c
+ */
+typedef struct _dmxfs
+{
+	/* the roots, or the index file with -o index */
+	char *basepath;
+	char *dbpath;
+	int verbose;
+	/* only used while setting up the database, every thread gets its own
+	 * connection through dmxfs_db()
+	 */
+	sqlite3 *db;
+	pthread_key_t db_key;
+	struct fuse_session *se;
+	/* tells the kernel to drop an entry, or an inode when @name is NULL.
+	 * Unset when nothing is mounted
+	 */
+	NodeInvalidateCb invalidate;
+	double entry_timeout;
+	double attr_timeout;
+	/* expose the files as regular files instead of symlinks */
+	int regular;
+	/* the database is a prebuilt index, served read only and never
+	 * scanned, see dmxfs_index.c
+	 */
+	int index;
+	/* serve the database as it is, without scanning */
+	int noscan;
+	/* split the files directories bigger than this on id ranges */
+	unsigned int bucket_size;
+	/* levels of the log categories, see log_config() */
+	char *log;
+	/* where the timeline is written on SIGUSR1, tracing is enabled then */
+	char *trace;
+	pthread_t tracer;
+	/* set by dmxfs_init() when the kernel offers FUSE_CAP_PASSTHROUGH,
+	 * dmxfs_open() then hands the files over with fuse_passthrough_open()
+	 */
+	int passthrough;
+	/* every root known by the index, the reachable ones are scanned */
+	GList *roots;
+	GList *scanners;
+	/* scanners still running, the last one collects the orphan caps */
+	unsigned int scanning;
+#if HAVE_INOTIFY
+	pthread_t monitor;
+	int inotify_fd;
+	int inotify_wd;
+#endif
+} dmxfs;
+
+/* A directory tree of the index. The roots are given on the command line
+ * separated by colons, any of them can be on a removable disk
+ */
+typedef struct _dmxfs_root
+{
+	unsigned int id;
+	char *path;
+	/* not reachable on mount, its files are not listed nor scanned */
+	int offline;
+	/* the last scan that was complete, see scan_sweep() */
+	unsigned int generation;
+} dmxfs_root;
+
+/* the GStreamer pipelines of a scanner, see dmxfs_scan.c */
+typedef struct _ScanPipelines ScanPipelines;
+
+/* every reachable root is scanned on its own thread with its own pipelines */
+typedef struct _dmxfs_scanner
+{
+	dmxfs *mfs;
+	dmxfs_root *root;
+	pthread_t thread;
+	dmxfs_scan_stats stats;
+	/* every file found is marked with the generation of the scan, the
+	 * ones not marked once it is complete were deleted. Nothing is marked
+	 * when NULL
+	 */
+	unsigned int generation;
+	GArray *seen;
+	/* directories that could not be read, their files were not marked */
+	unsigned int errors;
+	/* created on demand, see scan_pipelines_get() */
+	ScanPipelines *pipelines;
+	/* when the pipelines were last used */
+	uint64_t gst_used;
+	/* set by dmxfs_scan_stop(), the walk ends on the next entry */
+	int stop;
+} dmxfs_scanner;
+
+sqlite3 * dmxfs_db(dmxfs *mfs);
+int db_setup(dmxfs *mfs);
+unsigned int db_root_add(sqlite3 *db, const char *path);
+int db_insert_file(sqlite3 *db, const char *file, time_t mtime, off_t size,
+		unsigned int root);
+void db_insert_filecap(sqlite3 *db, int file_id, int cap_id);
+void db_delete_filecaps(sqlite3 *db, int file_id);
+int db_file_changed(sqlite3 *db, const char *file, time_t mtime, int *id);
+void db_vacuum(sqlite3 *db);
+int root_reachable(const char *path);
+void root_free(dmxfs_root *root);
+void dmxfs_free(dmxfs *mfs);
+
+uint64_t scan_now(void);
+void scan_pipelines_get(dmxfs_scanner *s);
+void scan_pipelines_put(dmxfs_scanner *s, int force);
+uint64_t scan_file(dmxfs_scanner *s, char *file, time_t mtime, off_t size,
+		uint64_t start);
+void scan_dir(dmxfs_scanner *s, const char *path);
+void dmxfs_scan(dmxfs *mfs);
+void dmxfs_scan_stop(dmxfs *mfs);
 
 #endif
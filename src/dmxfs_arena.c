@@ -0,0 +1,98 @@
+#ifdef HAVE_CONFIG_H
+#include "config.h"
+#endif
+
+#include <stdlib.h>
+#include <string.h>
+#include <stdio.h>
+#include <stdint.h>
+#include <pthread.h>
+#include <glib.h>
+#include <sqlite3.h>
+#include "dmxfs.h"
+/*============================================================================*
+ *                                  Local                                     *
+ *============================================================================*/
+/* An arena is a list of chunks where the allocations are placed one after
+ * the other. Nothing is freed individually, the whole arena is released at
+ * once when the request that owns it is done
+ */
+struct _ArenaChunk
+{
+	struct _ArenaChunk *next;
+	size_t size;
+	size_t used;
+	char data[];
+};
+
+#define ARENA_ALIGN(s) (((s) + sizeof(void *) - 1) & ~(sizeof(void *) - 1))
+
+static ArenaChunk * arena_chunk_new(size_t size)
+{
+	ArenaChunk *chunk;
+
+	chunk = malloc(sizeof(ArenaChunk) + size);
+	chunk->next = NULL;
+	chunk->size = size;
+	chunk->used = 0;
+
+	return chunk;
+}
+/*============================================================================*
+ *                                 Global                                     *
+ *============================================================================*/
+Arena * arena_new(size_t chunk_size)
+{
+	Arena *arena;
+
+	arena = malloc(sizeof(Arena));
+	arena->chunks = NULL;
+	arena->chunk_size = chunk_size;
+
+	return arena;
+}
+
+void * arena_alloc(Arena *arena, size_t size)
+{
+	ArenaChunk *chunk = arena->chunks;
+	void *ret;
+
+	size = ARENA_ALIGN(size);
+	if (!chunk || chunk->size - chunk->used < size)
+	{
+		/* big allocations get a chunk of their own */
+		chunk = arena_chunk_new(size > arena->chunk_size ?
+				size : arena->chunk_size);
+		chunk->next = arena->chunks;
+		arena->chunks = chunk;
+	}
+	ret = chunk->data + chunk->used;
+	chunk->used += size;
+
+	return ret;
+}
+
+char * arena_strdup(Arena *arena, const char *str)
+{
+	size_t len = strlen(str) + 1;
+	char *ret;
+
+	ret = arena_alloc(arena, len);
+	memcpy(ret, str, len);
+
+	return ret;
+}
+
+void arena_free(Arena *arena)
+{
+	ArenaChunk *chunk = arena->chunks;
+
+	while (chunk)
+	{
+		ArenaChunk *next = chunk->next;
+
+		free(chunk);
+		chunk = next;
+	}
+	free(arena);
+}
@@ -0,0 +1,451 @@
+/* Benchmark of the FUSE operations over a synthetic index. The filesystem
+ * is not mounted, the low level callbacks are called directly and the
+ * replies are caught by the functions below, see dmxfs_reply_set().
+ * Everything else is the same code dmxfs runs
+ */
+#ifdef HAVE_CONFIG_H
+#include "config.h"
+#endif
+
+#define FUSE_USE_VERSION 312
+#include <fuse_lowlevel.h>
+#include <stdlib.h>
+#include <string.h>
+#include <stdio.h>
+#include <stdint.h>
+#include <limits.h>
+#include <getopt.h>
+#include <pthread.h>
+#include <glib.h>
+#include <sqlite3.h>
+#include "dmxfs.h"
+#include "dmxfs_fuse.h"
+#include "dmxfs_bench.h"
+/*============================================================================*
+ *                                  Local                                     *
+ *============================================================================*/
+#define BENCH_DB_PATH "/tmp/dmxfs-bench.db"
+/* what the kernel asks for on every readdir */
+#define BENCH_READDIR_SIZE 4096
+/* same layout as struct fuse_dirent and struct fuse_entry_out */
+#define BENCH_DIRENT_SIZE 24
+#define BENCH_ENTRY_OUT_SIZE 128
+#define BENCH_DIRENT_ALIGN(s) (((s) + 7) & ~(size_t)7)
+
+/* what the operations reply, passed to them as their request */
+typedef struct _BenchReq
+{
+	dmxfs *mfs;
+	int err;
+	size_t size;
+	fuse_ino_t ino;
+	/* offset of the last entry added to a readdir reply */
+	off_t off;
+} BenchReq;
+
+#define BENCH_REQ(b) ((fuse_req_t)&(b)->req)
+
+typedef struct _BenchConfig
+{
+	char *dbpath;
+	BenchIndex index;
+	unsigned int iterations;
+	unsigned int listings;
+	unsigned int bucket_size;
+	int reuse;
+} BenchConfig;
+
+typedef struct _Bench
+{
+	BenchConfig *config;
+	dmxfs *mfs;
+	BenchReq req;
+	FILE *out;
+} Bench;
+
+typedef int (*BenchOpCb)(Bench *b, fuse_ino_t ino);
+
+/* the replies are caught here, the requests are always a BenchReq */
+static void * bench_userdata(fuse_req_t req)
+{
+	return ((BenchReq *)req)->mfs;
+}
+
+static int bench_reply_err(fuse_req_t req, int err)
+{
+	((BenchReq *)req)->err = err;
+	return 0;
+}
+
+static void bench_reply_none(fuse_req_t req)
+{
+}
+
+static int bench_reply_entry(fuse_req_t req, const struct fuse_entry_param *e)
+{
+	((BenchReq *)req)->ino = e->ino;
+	return 0;
+}
+
+static int bench_reply_attr(fuse_req_t req, const struct stat *attr,
+		double attr_timeout)
+{
+	((BenchReq *)req)->ino = attr->st_ino;
+	return 0;
+}
+
+static int bench_reply_readlink(fuse_req_t req, const char *link)
+{
+	((BenchReq *)req)->size = strlen(link);
+	return 0;
+}
+
+static int bench_reply_open(fuse_req_t req, const struct fuse_file_info *fi)
+{
+	return 0;
+}
+
+static int bench_reply_buf(fuse_req_t req, const char *buf, size_t size)
+{
+	((BenchReq *)req)->size = size;
+	return 0;
+}
+
+static int bench_reply_data(fuse_req_t req, struct fuse_bufvec *bufv,
+		enum fuse_buf_copy_flags flags)
+{
+	((BenchReq *)req)->size = bufv->buf[0].size;
+	return 0;
+}
+
+static int bench_reply_statfs(fuse_req_t req, const struct statvfs *stbuf)
+{
+	return 0;
+}
+
+static int bench_reply_xattr(fuse_req_t req, size_t count)
+{
+	((BenchReq *)req)->size = count;
+	return 0;
+}
+
+static size_t bench_add_direntry(fuse_req_t req, char *buf, size_t bufsize,
+		const char *name, const struct stat *stbuf, off_t off)
+{
+	size_t namelen = strlen(name);
+	size_t len;
+
+	len = BENCH_DIRENT_ALIGN(BENCH_DIRENT_SIZE + namelen);
+	if (!buf || len > bufsize)
+		return len;
+	memcpy(buf + BENCH_DIRENT_SIZE, name, namelen);
+	((BenchReq *)req)->off = off;
+
+	return len;
+}
+
+static size_t bench_add_direntry_plus(fuse_req_t req, char *buf,
+		size_t bufsize, const char *name, const struct fuse_entry_param *e,
+		off_t off)
+{
+	size_t namelen = strlen(name);
+	size_t len;
+
+	len = BENCH_ENTRY_OUT_SIZE +
+			BENCH_DIRENT_ALIGN(BENCH_DIRENT_SIZE + namelen);
+	if (!buf || len > bufsize)
+		return len;
+	memcpy(buf + BENCH_ENTRY_OUT_SIZE + BENCH_DIRENT_SIZE, name, namelen);
+	((BenchReq *)req)->off = off;
+
+	return len;
+}
+
+static const dmxfs_reply _bench_reply = {
+	.userdata          = bench_userdata,
+	.err               = bench_reply_err,
+	.none              = bench_reply_none,
+	.entry             = bench_reply_entry,
+	.attr              = bench_reply_attr,
+	.readlink          = bench_reply_readlink,
+	.open              = bench_reply_open,
+	.buf               = bench_reply_buf,
+	.data              = bench_reply_data,
+	.statfs            = bench_reply_statfs,
+	.xattr             = bench_reply_xattr,
+	.add_direntry      = bench_add_direntry,
+	.add_direntry_plus = bench_add_direntry_plus,
+};
+
+static void bench_req_reset(Bench *b)
+{
+	b->req.mfs = b->mfs;
+	b->req.err = 0;
+	b->req.size = 0;
+	b->req.ino = 0;
+	b->req.off = 0;
+}
+
+static fuse_ino_t bench_lookup(Bench *b, fuse_ino_t parent, const char *name)
+{
+	bench_req_reset(b);
+	dmxfs_ops.lookup(BENCH_REQ(b), parent, name);
+	if (b->req.err)
+	{
+		fprintf(b->out, "could not lookup %s: %s\n", name, strerror(b->req.err));
+		return 0;
+	}
+	return b->req.ino;
+}
+
+/* any file, so the file data is not always on the cache */
+static fuse_ino_t bench_file(Bench *b)
+{
+	return node_ino_from_file(1 + random() % b->config->index.files);
+}
+
+static int bench_getattr(Bench *b, fuse_ino_t ino)
+{
+	bench_req_reset(b);
+	dmxfs_ops.getattr(BENCH_REQ(b), ino ? ino : bench_file(b), NULL);
+
+	return b->req.err;
+}
+
+static int bench_readlink(Bench *b, fuse_ino_t ino)
+{
+	bench_req_reset(b);
+	dmxfs_ops.readlink(BENCH_REQ(b), ino ? ino : bench_file(b));
+
+	return b->req.err;
+}
+
+/* a whole listing, as done by ls, from the opendir to the releasedir */
+static int bench_list(Bench *b, fuse_ino_t ino, int plus)
+{
+	struct fuse_file_info fi;
+	off_t off = 0;
+
+	memset(&fi, 0, sizeof(fi));
+	bench_req_reset(b);
+	dmxfs_ops.opendir(BENCH_REQ(b), ino, &fi);
+	if (b->req.err) return b->req.err;
+	do {
+		bench_req_reset(b);
+		if (plus)
+			dmxfs_ops.readdirplus(BENCH_REQ(b), ino, BENCH_READDIR_SIZE, off, &fi);
+		else
+			dmxfs_ops.readdir(BENCH_REQ(b), ino, BENCH_READDIR_SIZE, off, &fi);
+		if (b->req.err) break;
+		off = b->req.off;
+	} while (b->req.size);
+	bench_req_reset(b);
+	dmxfs_ops.releasedir(BENCH_REQ(b), ino, &fi);
+
+	return b->req.err;
+}
+
+static int bench_readdir(Bench *b, fuse_ino_t ino)
+{
+	return bench_list(b, ino, 0);
+}
+
+static int bench_readdirplus(Bench *b, fuse_ino_t ino)
+{
+	return bench_list(b, ino, 1);
+}
+
+/* run @cb @iterations times on @ino, the first call is not accounted so
+ * the numbers are the ones of a warm cache
+ */
+static void bench_run(Bench *b, const char *name, BenchOpCb cb,
+		fuse_ino_t ino, unsigned int iterations)
+{
+	uint64_t *lat;
+	uint64_t total = 0;
+	unsigned int i;
+	int err;
+
+	if (!iterations) return;
+	err = cb(b, ino);
+	if (err)
+	{
+		fprintf(b->out, "%-24s failed: %s\n", name, strerror(err));
+		return;
+	}
+	lat = malloc(sizeof(uint64_t) * iterations);
+	for (i = 0; i < iterations; i++)
+	{
+		uint64_t start;
+
+		start = bench_now();
+		cb(b, ino);
+		lat[i] = bench_now() - start;
+		total += lat[i];
+	}
+	qsort(lat, iterations, sizeof(uint64_t), bench_u64_cmp);
+	fprintf(b->out, "%-24s %10u %12.1f %10.2f %10.2f %10.2f\n", name,
+			iterations, iterations / (total / 1e9),
+			lat[(size_t)(iterations * 0.5)] / 1e3,
+			lat[(size_t)(iterations * 0.99)] / 1e3,
+			lat[(size_t)(iterations * 0.999)] / 1e3);
+	free(lat);
+}
+
+static void bench_usage(void)
+{
+	printf("Usage:\n");
+	printf("dmxfs-bench [options]\n");
+	printf("\n");
+	printf("    -d FILE       database to use (%s)\n", BENCH_DB_PATH);
+	printf("    -r            reuse the database instead of generating it\n");
+	printf("    -f N          number of files (10000)\n");
+	printf("    -c N          number of caps (64)\n");
+	printf("    -k N          mean number of caps per file (4)\n");
+	printf("    -z S          zipf exponent of the caps popularity (1.0)\n");
+	printf("    -n N          iterations of the single entry operations (100000)\n");
+	printf("    -l N          iterations of the listings (100)\n");
+	printf("    -b N          bucket size, as the bucket_size option (disabled)\n");
+	printf("    -L LEVELS     log levels, as the log option (warning)\n");
+	printf("\n");
+}
+/*============================================================================*
+ *                                 Global                                     *
+ *============================================================================*/
+int main(int argc, char **argv)
+{
+	BenchConfig config;
+	Bench b;
+	char name[PATH_MAX];
+	fuse_ino_t root_files;
+	fuse_ino_t cap;
+	fuse_ino_t cap_files;
+	fuse_ino_t subcap;
+	int opt;
+	int ret = 1;
+
+	memset(&config, 0, sizeof(config));
+	config.dbpath = BENCH_DB_PATH;
+	config.index.files = 10000;
+	config.index.caps = 64;
+	config.index.caps_per_file = 4;
+	config.index.zipf = 1.0;
+	config.iterations = 100000;
+	config.listings = 100;
+
+	while ((opt = getopt(argc, argv, "d:rf:c:k:z:n:l:b:L:h")) != -1)
+	{
+		switch (opt)
+		{
+			case 'd': config.dbpath = optarg; break;
+			case 'r': config.reuse = 1; break;
+			case 'f': config.index.files = strtoul(optarg, NULL, 10); break;
+			case 'c': config.index.caps = strtoul(optarg, NULL, 10); break;
+			case 'k': config.index.caps_per_file = strtoul(optarg, NULL, 10); break;
+			case 'z': config.index.zipf = strtod(optarg, NULL); break;
+			case 'n': config.iterations = strtoul(optarg, NULL, 10); break;
+			case 'l': config.listings = strtoul(optarg, NULL, 10); break;
+			case 'b': config.bucket_size = strtoul(optarg, NULL, 10); break;
+			case 'L':
+			if (!log_config(optarg))
+			{
+				bench_usage();
+				return 1;
+			}
+			break;
+			default:
+			bench_usage();
+			return opt != 'h';
+		}
+	}
+	if (config.index.files < 1 || config.index.caps < 2 || config.index.caps_per_file < 1)
+	{
+		bench_usage();
+		return 1;
+	}
+
+	memset(&b, 0, sizeof(b));
+	b.config = &config;
+	/* the log records are paid for as when mounted */
+	log_init();
+	b.out = bench_output();
+	if (!b.out)
+	{
+		printf("could not redirect the output\n");
+		return 1;
+	}
+
+	b.mfs = calloc(1, sizeof(dmxfs));
+	b.mfs->entry_timeout = DMXFS_ENTRY_TIMEOUT;
+	b.mfs->attr_timeout = DMXFS_ATTR_TIMEOUT;
+	b.mfs->bucket_size = config.bucket_size;
+	if (b.mfs->bucket_size > DMXFS_CACHE_MAX_FILES)
+		b.mfs->bucket_size = DMXFS_CACHE_MAX_FILES;
+	if (!config.reuse)
+		bench_db_remove(config.dbpath);
+	b.mfs->dbpath = strdup(config.dbpath);
+	if (!db_setup(b.mfs))
+	{
+		fprintf(b.out, "could not setup the database %s\n", config.dbpath);
+		free(b.mfs->dbpath);
+		b.mfs->dbpath = NULL;
+		goto end;
+	}
+	srandom(1);
+	if (!config.reuse)
+	{
+		uint64_t start = bench_now();
+
+		if (!bench_index_generate(dmxfs_db(b.mfs), &config.index))
+			goto end;
+		fprintf(b.out, "indexed %u files with %u caps in %.2f secs\n",
+				config.index.files, config.index.caps,
+				(bench_now() - start) / 1e9);
+	}
+	file_counters_load(dmxfs_db(b.mfs));
+	cap_counters_load(dmxfs_db(b.mfs));
+	file_counters_get(&config.index.files, NULL);
+	if (!config.index.files)
+	{
+		fprintf(b.out, "the database has no files\n");
+		goto end;
+	}
+	cache_init(DMXFS_CACHE_SIZE);
+	node_init();
+	dmxfs_reply_set(&_bench_reply);
+
+	/* the most popular cap, the one with the biggest listings, and the
+	 * second one inside of it
+	 */
+	bench_cap_name(name, sizeof(name), 0);
+	cap = bench_lookup(&b, FUSE_ROOT_ID, name);
+	bench_cap_name(name, sizeof(name), 1);
+	subcap = cap ? bench_lookup(&b, cap, name) : 0;
+	cap_files = cap ? bench_lookup(&b, cap, "files") : 0;
+	root_files = bench_lookup(&b, FUSE_ROOT_ID, "files");
+	if (!cap || !subcap || !cap_files || !root_files)
+		goto end;
+
+	fprintf(b.out, "%-24s %10s %12s %10s %10s %10s\n", "operation",
+			"count", "ops/s", "p50(us)", "p99(us)", "p999(us)");
+	bench_run(&b, "getattr /", bench_getattr, FUSE_ROOT_ID, config.iterations);
+	bench_run(&b, "getattr cap", bench_getattr, cap, config.iterations);
+	bench_run(&b, "getattr cap/files", bench_getattr, cap_files, config.iterations);
+	bench_run(&b, "getattr file", bench_getattr, 0, config.iterations);
+	if (!b.mfs->regular)
+		bench_run(&b, "readlink file", bench_readlink, 0, config.iterations);
+	bench_run(&b, "readdir /", bench_readdir, FUSE_ROOT_ID, config.listings);
+	bench_run(&b, "readdir cap", bench_readdir, cap, config.listings);
+	bench_run(&b, "readdir cap/cap", bench_readdir, subcap, config.listings);
+	bench_run(&b, "readdir cap/files", bench_readdir, cap_files, config.listings);
+	bench_run(&b, "readdir files", bench_readdir, root_files, config.listings);
+	bench_run(&b, "readdirplus cap", bench_readdirplus, cap, config.listings);
+	bench_run(&b, "readdirplus cap/files", bench_readdirplus, cap_files, config.listings);
+	ret = 0;
+end:
+	dmxfs_free(b.mfs);
+	log_shutdown();
+	fclose(b.out);
+
+	return ret;
+}
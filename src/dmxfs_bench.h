@@ -0,0 +1,22 @@
+#ifndef DMXFS_BENCH_H_
+#define DMXFS_BENCH_H_
+
+/* shape of a synthetic index, see dmxfs_bench_common.c */
+typedef struct _BenchIndex
+{
+	unsigned int files;
+	unsigned int caps;
+	/* mean number of caps of every file */
+	unsigned int caps_per_file;
+	/* the popularity of the caps follows a zipf distribution */
+	double zipf;
+} BenchIndex;
+
+uint64_t bench_now(void);
+int bench_u64_cmp(const void *a, const void *b);
+FILE * bench_output(void);
+void bench_db_remove(const char *path);
+void bench_cap_name(char *name, size_t len, unsigned int rank);
+int bench_index_generate(sqlite3 *db, BenchIndex *index);
+
+#endif
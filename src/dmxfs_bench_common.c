@@ -0,0 +1,198 @@
+#ifdef HAVE_CONFIG_H
+#include "config.h"
+#endif
+
+#include <stdlib.h>
+#include <string.h>
+#include <stdio.h>
+#include <stdint.h>
+#include <limits.h>
+#include <math.h>
+#include <time.h>
+#include <unistd.h>
+#include <pthread.h>
+#include <glib.h>
+#include <sqlite3.h>
+#include "dmxfs.h"
+#include "dmxfs_bench.h"
+/*============================================================================*
+ *                                  Local                                     *
+ *============================================================================*/
+/* pick a cap following the cumulative distribution @cdf */
+static unsigned int bench_cap_pick(double *cdf, unsigned int num)
+{
+	double v = (double)random() / RAND_MAX;
+	unsigned int lo = 0;
+	unsigned int hi = num - 1;
+
+	while (lo < hi)
+	{
+		unsigned int mid = (lo + hi) / 2;
+
+		if (cdf[mid] < v) lo = mid + 1;
+		else hi = mid;
+	}
+	return lo;
+}
+/*============================================================================*
+ *                                 Global                                     *
+ *============================================================================*/
+uint64_t bench_now(void)
+{
+	struct timespec ts;
+
+	clock_gettime(CLOCK_MONOTONIC, &ts);
+	return (uint64_t)ts.tv_sec * 1000000000ULL + ts.tv_nsec;
+}
+
+int bench_u64_cmp(const void *a, const void *b)
+{
+	uint64_t ia = *(const uint64_t *)a;
+	uint64_t ib = *(const uint64_t *)b;
+
+	return ia < ib ? -1 : ia > ib;
+}
+
+/**
+ * Get the stream for the report of a benchmark. Anything else written to
+ * stdout is sent to /dev/null from now on, the returned stream writes to
+ * the real stdout
+ */
+FILE * bench_output(void)
+{
+	FILE *out;
+
+	fflush(stdout);
+	out = fdopen(dup(STDOUT_FILENO), "w");
+	if (!out) return NULL;
+	if (!freopen("/dev/null", "w", stdout))
+	{
+		fclose(out);
+		return NULL;
+	}
+	setvbuf(out, NULL, _IOLBF, 0);
+
+	return out;
+}
+
+/**
+ * Remove the database at @path together with its write-ahead log
+ */
+void bench_db_remove(const char *path)
+{
+	char name[PATH_MAX];
+
+	snprintf(name, sizeof(name), "%s-wal", path);
+	unlink(name);
+	snprintf(name, sizeof(name), "%s-shm", path);
+	unlink(name);
+	unlink(path);
+}
+
+/**
+ * Name of the cap at position @rank of popularity, zero being the most
+ * popular one
+ */
+void bench_cap_name(char *name, size_t len, unsigned int rank)
+{
+	snprintf(name, len, "bench_cap%04u", rank);
+}
+
+/**
+ * Fill an empty database with the files of @index, every one with a
+ * uniform number of caps around the mean and each cap chosen by its
+ * popularity. Everything is inserted on a single transaction
+ */
+int bench_index_generate(sqlite3 *db, BenchIndex *index)
+{
+	sqlite3_stmt *file_stmt = NULL;
+	sqlite3_stmt *filecap_stmt = NULL;
+	Cap **caps;
+	double *cdf;
+	double total = 0;
+	unsigned int *picked;
+	unsigned int i;
+	int ret = 0;
+
+	caps = calloc(index->caps, sizeof(Cap *));
+	cdf = malloc(sizeof(double) * index->caps);
+	picked = malloc(sizeof(unsigned int) * index->caps);
+	for (i = 0; i < index->caps; i++)
+	{
+		total += 1.0 / pow(i + 1, index->zipf);
+		cdf[i] = total;
+	}
+	for (i = 0; i < index->caps; i++)
+		cdf[i] /= total;
+
+	sqlite3_exec(db, "BEGIN;", NULL, NULL, NULL);
+	for (i = 0; i < index->caps; i++)
+	{
+		char name[PATH_MAX];
+
+		bench_cap_name(name, sizeof(name), i);
+		caps[i] = cap_new_from_name(db, name);
+		if (!caps[i])
+		{
+			fprintf(stderr, "could not create the cap %s\n", name);
+			goto end;
+		}
+	}
+	if (sqlite3_prepare_v2(db, "INSERT INTO files (file, mtime, size) VALUES (?, ?, ?);",
+			-1, &file_stmt, NULL) != SQLITE_OK ||
+			sqlite3_prepare_v2(db, "INSERT INTO filecaps (file, cap) VALUES (?, ?);",
+			-1, &filecap_stmt, NULL) != SQLITE_OK)
+	{
+		fprintf(stderr, "could not prepare the inserts: %s\n", sqlite3_errmsg(db));
+		goto end;
+	}
+	for (i = 0; i < index->files; i++)
+	{
+		char name[PATH_MAX];
+		sqlite3_int64 id;
+		unsigned int num;
+		unsigned int j;
+
+		snprintf(name, sizeof(name), "/bench/%08u.mkv", i);
+		sqlite3_reset(file_stmt);
+		sqlite3_bind_text(file_stmt, 1, name, -1, SQLITE_TRANSIENT);
+		sqlite3_bind_int64(file_stmt, 2, time(NULL));
+		sqlite3_bind_int64(file_stmt, 3, ((sqlite3_int64)(random() % 4096) + 1) << 20);
+		if (sqlite3_step(file_stmt) != SQLITE_DONE)
+		{
+			fprintf(stderr, "could not insert a file: %s\n", sqlite3_errmsg(db));
+			goto end;
+		}
+		id = sqlite3_last_insert_rowid(db);
+
+		num = 1 + random() % (2 * index->caps_per_file - 1);
+		if (num > index->caps) num = index->caps;
+		for (j = 0; j < num; j++)
+		{
+			unsigned int k;
+			unsigned int c;
+
+			/* a file does not have the same cap twice */
+			do {
+				c = bench_cap_pick(cdf, index->caps);
+				for (k = 0; k < j && picked[k] != c; k++);
+			} while (k < j);
+			picked[j] = c;
+
+			sqlite3_reset(filecap_stmt);
+			sqlite3_bind_int64(filecap_stmt, 1, id);
+			sqlite3_bind_int(filecap_stmt, 2, caps[c]->id);
+			sqlite3_step(filecap_stmt);
+		}
+	}
+	ret = 1;
+end:
+	if (file_stmt) sqlite3_finalize(file_stmt);
+	if (filecap_stmt) sqlite3_finalize(filecap_stmt);
+	sqlite3_exec(db, ret ? "COMMIT;" : "ROLLBACK;", NULL, NULL, NULL);
+	free(picked);
+	free(cdf);
+	free(caps);
+
+	return ret;
+}
@@ -0,0 +1,406 @@
+/* Benchmark of the queries behind the listings. For every index size the
+ * database is filled with a synthetic index and every family of queries
+ * is run on paths of one to five caps, both of the most popular caps and
+ * of the least popular ones. Every result is a JSON object on its own
+ * line with the timings, the rows and the plan sqlite chose
+ */
+#ifdef HAVE_CONFIG_H
+#include "config.h"
+#endif
+
+#include <stdlib.h>
+#include <string.h>
+#include <stdio.h>
+#include <stdint.h>
+#include <limits.h>
+#include <getopt.h>
+#include <sys/stat.h>
+#include <pthread.h>
+#include <glib.h>
+#include <sqlite3.h>
+#include "dmxfs.h"
+#include "dmxfs_bench.h"
+/*============================================================================*
+ *                                  Local                                     *
+ *============================================================================*/
+#define BENCH_DB_PATH "/tmp/dmxfs-bench-query"
+#define BENCH_SIZES "100000,1000000,10000000"
+#define BENCH_MAX_DEPTH 5
+
+typedef struct _BenchConfig
+{
+	char *dbpath;
+	char *sizes;
+	BenchIndex index;
+	unsigned int runs;
+	/* files on a page, as read by readdir */
+	unsigned int limit;
+	int reuse;
+} BenchConfig;
+
+/* run a query of the family, returns the number of rows */
+typedef unsigned int (*BenchQueryCb)(sqlite3 *db, GList *caps, Query *query,
+		unsigned int limit);
+
+typedef struct _BenchFamily
+{
+	const char *name;
+	BenchQueryCb cb;
+	/* the caps are passed as a query expression instead of a path */
+	int query;
+} BenchFamily;
+
+static unsigned int bench_files_page(sqlite3 *db, GList *caps, Query *query,
+		unsigned int limit)
+{
+	FileSet *set;
+	unsigned int ret;
+
+	set = file_get_from_caps(db, caps, query, 0, 0, limit);
+	ret = set->count;
+	file_set_free(set);
+
+	return ret;
+}
+
+static unsigned int bench_files_ids(sqlite3 *db, GList *caps, Query *query,
+		unsigned int limit)
+{
+	CacheResult *r;
+	unsigned int ret;
+
+	/* as readdir_files(), one more to know that it does not fit */
+	r = file_get_ids_from_caps(db, caps, query, 0, 0,
+			DMXFS_CACHE_MAX_FILES + 1);
+	ret = r->count;
+	cache_result_unref(r);
+
+	return ret;
+}
+
+static unsigned int bench_subcaps(sqlite3 *db, GList *caps, Query *query,
+		unsigned int limit)
+{
+	CacheResult *r;
+	unsigned int ret;
+
+	r = cap_get_different_from_caps(db, caps, query);
+	ret = r->count;
+	cache_result_unref(r);
+
+	return ret;
+}
+
+static BenchFamily _families[] = {
+	{ "files_page", bench_files_page, 0 },
+	{ "files_ids", bench_files_ids, 0 },
+	{ "files_query", bench_files_ids, 1 },
+	{ "subcaps", bench_subcaps, 0 },
+	{ "subcaps_query", bench_subcaps, 1 },
+};
+
+#define BENCH_FAMILIES (sizeof(_families) / sizeof(BenchFamily))
+
+/* the first statement run by a query, the ones of the triggers start
+ * with a comment
+ */
+static int _sql_stmt(unsigned int type, void *data, void *p, void *x)
+{
+	char **sql = data;
+	const char *str = x;
+
+	if (*sql || !strncmp(str, "--", 2))
+		return 0;
+	*sql = g_strdup(str);
+
+	return 0;
+}
+
+static void bench_json_string(FILE *out, const char *str)
+{
+	fputc('"', out);
+	for (; *str; str++)
+	{
+		if (*str == '"' || *str == '\\')
+			fprintf(out, "\\%c", *str);
+		else if ((unsigned char)*str < 0x20)
+			fprintf(out, "\\u%04x", *str);
+		else
+			fputc(*str, out);
+	}
+	fputc('"', out);
+}
+
+static void bench_plan(FILE *out, sqlite3 *db, const char *sql)
+{
+	sqlite3_stmt *stmt;
+	char *str;
+	int first = 1;
+
+	fprintf(out, "[");
+	str = sqlite3_mprintf("EXPLAIN QUERY PLAN %s", sql);
+	if (sqlite3_prepare_v2(db, str, -1, &stmt, NULL) == SQLITE_OK)
+	{
+		while (sqlite3_step(stmt) == SQLITE_ROW)
+		{
+			if (!first) fprintf(out, ",");
+			bench_json_string(out, (const char *)sqlite3_column_text(stmt, 3));
+			first = 0;
+		}
+		sqlite3_finalize(stmt);
+	}
+	sqlite3_free(str);
+	fprintf(out, "]");
+}
+
+/* run the query @runs times after a first one to warm the page cache */
+static void bench_run(BenchConfig *config, FILE *out, sqlite3 *db,
+		BenchFamily *family, const char *path, GList *caps, Query *query)
+{
+	uint64_t *lat;
+	uint64_t total = 0;
+	char *sql = NULL;
+	unsigned int rows;
+	unsigned int i;
+
+	sqlite3_trace_v2(db, SQLITE_TRACE_STMT, _sql_stmt, &sql);
+	rows = family->cb(db, caps, query, config->limit);
+	sqlite3_trace_v2(db, 0, NULL, NULL);
+
+	lat = malloc(sizeof(uint64_t) * config->runs);
+	for (i = 0; i < config->runs; i++)
+	{
+		uint64_t start;
+
+		start = bench_now();
+		family->cb(db, caps, query, config->limit);
+		lat[i] = bench_now() - start;
+		total += lat[i];
+	}
+	qsort(lat, config->runs, sizeof(uint64_t), bench_u64_cmp);
+
+	fprintf(out, "{\"files\":%u,\"caps\":%u,\"family\":\"%s\",\"path\":\"%s\","
+			"\"depth\":%u,\"runs\":%u,\"rows\":%u,"
+			"\"mean_us\":%.2f,\"p50_us\":%.2f,\"max_us\":%.2f,"
+			"\"rows_per_sec\":%.1f,\"plan\":",
+			config->index.files, config->index.caps, family->name, path,
+			g_list_length(caps), config->runs, rows,
+			total / 1e3 / config->runs,
+			lat[config->runs / 2] / 1e3,
+			lat[config->runs - 1] / 1e3,
+			total ? rows * (double)config->runs / (total / 1e9) : 0);
+	if (sql)
+		bench_plan(out, db, sql);
+	else
+		fprintf(out, "[]");
+	fprintf(out, "}\n");
+	g_free(sql);
+	free(lat);
+}
+
+/* the query with every cap of the path as a term of its own */
+static Query * bench_query(GList *caps)
+{
+	GString *expr;
+	Query *q;
+	GList *l;
+
+	expr = g_string_new("");
+	for (l = caps; l; l = l->next)
+	{
+		Cap *cap = l->data;
+
+		g_string_append_printf(expr, "%s%s", l == caps ? "" : ",",
+				cap->name);
+	}
+	q = query_parse(expr->str, NULL);
+	g_string_free(expr, TRUE);
+
+	return q;
+}
+
+/* the @depth most popular caps or the @depth least popular ones */
+static GList * bench_path(BenchConfig *config, unsigned int depth, int rare)
+{
+	GList *caps = NULL;
+	unsigned int i;
+
+	for (i = 0; i < depth; i++)
+	{
+		char name[PATH_MAX];
+		Cap *cap;
+
+		bench_cap_name(name, sizeof(name), rare ?
+				config->index.caps - 1 - i : i);
+		cap = cap_get_from_name(name);
+		if (!cap)
+		{
+			g_list_free(caps);
+			return NULL;
+		}
+		caps = g_list_append(caps, cap);
+	}
+
+	return caps;
+}
+
+static int bench_size(BenchConfig *config, FILE *out)
+{
+	struct stat st;
+	char path[PATH_MAX];
+	dmxfs *mfs;
+	sqlite3 *db;
+	unsigned int depth;
+	int generate = 1;
+	int ret = 0;
+
+	snprintf(path, sizeof(path), "%s-%u.db", config->dbpath,
+			config->index.files);
+	if (config->reuse && !stat(path, &st))
+		generate = 0;
+	else
+		bench_db_remove(path);
+
+	mfs = calloc(1, sizeof(dmxfs));
+	mfs->dbpath = strdup(path);
+	if (!db_setup(mfs))
+	{
+		fprintf(out, "could not setup the database %s\n", path);
+		free(mfs->dbpath);
+		mfs->dbpath = NULL;
+		goto end;
+	}
+	db = dmxfs_db(mfs);
+	if (generate)
+	{
+		uint64_t start = bench_now();
+
+		srandom(1);
+		if (!bench_index_generate(db, &config->index))
+			goto end;
+		fprintf(out, "{\"files\":%u,\"caps\":%u,\"generate_secs\":%.2f}\n",
+				config->index.files, config->index.caps,
+				(bench_now() - start) / 1e9);
+	}
+
+	for (depth = 1; depth <= BENCH_MAX_DEPTH; depth++)
+	{
+		int rare;
+
+		for (rare = 0; rare < 2; rare++)
+		{
+			GList *caps;
+			Query *q;
+			unsigned int i;
+
+			caps = bench_path(config, depth, rare);
+			if (!caps) continue;
+			q = bench_query(caps);
+			for (i = 0; i < BENCH_FAMILIES; i++)
+			{
+				BenchFamily *family = &_families[i];
+
+				if (family->query)
+					bench_run(config, out, db, family,
+							rare ? "rare" : "popular", NULL, q);
+				else
+					bench_run(config, out, db, family,
+							rare ? "rare" : "popular", caps, NULL);
+			}
+			query_unref(q);
+			g_list_free(caps);
+		}
+	}
+	ret = 1;
+end:
+	dmxfs_free(mfs);
+
+	return ret;
+}
+
+static void bench_usage(void)
+{
+	printf("Usage:\n");
+	printf("dmxfs-bench-query [options]\n");
+	printf("\n");
+	printf("    -d PREFIX     prefix of the databases, one per size (%s)\n",
+			BENCH_DB_PATH);
+	printf("    -r            reuse the databases instead of generating them\n");
+	printf("    -s N,N,...    number of files of every index (%s)\n",
+			BENCH_SIZES);
+	printf("    -c N          number of caps (200)\n");
+	printf("    -k N          mean number of caps per file (4)\n");
+	printf("    -z S          zipf exponent of the caps popularity (1.0)\n");
+	printf("    -n N          runs of every query (10)\n");
+	printf("    -l N          files on a page (1024)\n");
+	printf("\n");
+}
+/*============================================================================*
+ *                                 Global                                     *
+ *============================================================================*/
+int main(int argc, char **argv)
+{
+	BenchConfig config;
+	FILE *out;
+	char *sizes;
+	char *size;
+	char *saveptr;
+	int opt;
+	int ret = 0;
+
+	memset(&config, 0, sizeof(config));
+	config.dbpath = BENCH_DB_PATH;
+	config.sizes = BENCH_SIZES;
+	config.index.caps = 200;
+	config.index.caps_per_file = 4;
+	config.index.zipf = 1.0;
+	config.runs = 10;
+	config.limit = 1024;
+
+	while ((opt = getopt(argc, argv, "d:rs:c:k:z:n:l:h")) != -1)
+	{
+		switch (opt)
+		{
+			case 'd': config.dbpath = optarg; break;
+			case 'r': config.reuse = 1; break;
+			case 's': config.sizes = optarg; break;
+			case 'c': config.index.caps = strtoul(optarg, NULL, 10); break;
+			case 'k': config.index.caps_per_file = strtoul(optarg, NULL, 10); break;
+			case 'z': config.index.zipf = strtod(optarg, NULL); break;
+			case 'n': config.runs = strtoul(optarg, NULL, 10); break;
+			case 'l': config.limit = strtoul(optarg, NULL, 10); break;
+			default:
+			bench_usage();
+			return opt != 'h';
+		}
+	}
+	if (config.index.caps < 2 * BENCH_MAX_DEPTH ||
+			config.index.caps_per_file < 1 || !config.runs)
+	{
+		bench_usage();
+		return 1;
+	}
+
+	out = bench_output();
+	if (!out)
+	{
+		printf("could not redirect the output\n");
+		return 1;
+	}
+	sizes = strdup(config.sizes);
+	for (size = strtok_r(sizes, ",", &saveptr); size;
+			size = strtok_r(NULL, ",", &saveptr))
+	{
+		config.index.files = strtoul(size, NULL, 10);
+		if (!config.index.files) continue;
+		if (!bench_size(&config, out))
+		{
+			ret = 1;
+			break;
+		}
+	}
+	free(sizes);
+	fclose(out);
+
+	return ret;
+}
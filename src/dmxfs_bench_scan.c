@@ -0,0 +1,457 @@
+/* Benchmark of the scanner. A corpus of small media files of several
+ * containers, mixed with files that are not media, is generated with
+ * GStreamer on a tree of directories and then scanned twice, the first
+ * time on an empty database and the second one with nothing changed.
+ * The scanner is the same code dmxfs runs, called on this thread
+ */
+#ifdef HAVE_CONFIG_H
+#include "config.h"
+#endif
+
+#include <stdlib.h>
+#include <string.h>
+#include <stdio.h>
+#include <stdint.h>
+#include <limits.h>
+#include <errno.h>
+#include <getopt.h>
+#include <sys/stat.h>
+#include <pthread.h>
+#include <glib.h>
+#include <sqlite3.h>
+#include <gst/gst.h>
+#include "dmxfs.h"
+#include "dmxfs_bench.h"
+/*============================================================================*
+ *                                  Local                                     *
+ *============================================================================*/
+#define BENCH_CORPUS_PATH "/tmp/dmxfs-corpus"
+#define BENCH_DB_PATH "/tmp/dmxfs-bench-scan.db"
+/* seconds to wait for a template to be encoded */
+#define BENCH_ENCODE_TIMEOUT 60
+
+/* every template is encoded once and copied all over the corpus, the
+ * first %u is the number of buffers and the %s the location
+ */
+typedef struct _BenchTemplate
+{
+	const char *ext;
+	const char *pipeline;
+	char *data;
+	size_t size;
+} BenchTemplate;
+
+static BenchTemplate _templates[] = {
+	{ .ext = "ogg",
+		.pipeline = "audiotestsrc num-buffers=%u ! audioconvert ! vorbisenc ! oggmux ! "
+			"filesink location=%s" },
+	{ .ext = "wav",
+		.pipeline = "audiotestsrc num-buffers=%u ! audioconvert ! wavenc ! "
+			"filesink location=%s" },
+	{ .ext = "flac",
+		.pipeline = "audiotestsrc num-buffers=%u ! audioconvert ! flacenc ! "
+			"filesink location=%s" },
+	{ .ext = "mp3",
+		.pipeline = "audiotestsrc num-buffers=%u ! audioconvert ! lamemp3enc ! "
+			"filesink location=%s" },
+	{ .ext = "ogv",
+		.pipeline = "videotestsrc num-buffers=%u ! theoraenc ! oggmux ! "
+			"filesink location=%s" },
+	{ .ext = "avi",
+		.pipeline = "videotestsrc num-buffers=%u ! jpegenc ! avimux ! "
+			"filesink location=%s" },
+	{ .ext = "mkv",
+		.pipeline = "videotestsrc num-buffers=%u ! theoraenc ! queue ! "
+			"matroskamux name=mux ! filesink location=%s "
+			"audiotestsrc num-buffers=50 ! audioconvert ! vorbisenc ! queue ! mux." },
+};
+
+#define BENCH_TEMPLATES (sizeof(_templates) / sizeof(BenchTemplate))
+
+typedef struct _BenchConfig
+{
+	char *corpus;
+	char *dbpath;
+	unsigned int media;
+	unsigned int junk;
+	unsigned int depth;
+	unsigned int fanout;
+	unsigned int buffers;
+} BenchConfig;
+
+typedef struct _BenchSql
+{
+	unsigned int statements;
+	uint64_t time;
+} BenchSql;
+
+static uint64_t bench_rchar(void)
+{
+	FILE *f;
+	char line[256];
+	unsigned long long v = 0;
+
+	f = fopen("/proc/self/io", "r");
+	if (!f) return 0;
+	while (fgets(line, sizeof(line), f))
+	{
+		if (sscanf(line, "rchar: %llu", &v) == 1)
+			break;
+	}
+	fclose(f);
+
+	return v;
+}
+
+static int _sql_profile(unsigned int type, void *data, void *p, void *x)
+{
+	BenchSql *sql = data;
+
+	sql->statements++;
+	sql->time += *(sqlite3_int64 *)x;
+
+	return 0;
+}
+
+static int bench_mkdirs(char *path)
+{
+	char *sep;
+
+	for (sep = strchr(path + 1, '/'); sep; sep = strchr(sep + 1, '/'))
+	{
+		*sep = '\0';
+		if (mkdir(path, 0755) < 0 && errno != EEXIST)
+		{
+			*sep = '/';
+			return 0;
+		}
+		*sep = '/';
+	}
+	return 1;
+}
+
+/* the files are spread on a tree of @depth levels of @fanout directories */
+static void bench_file_path(BenchConfig *config, unsigned int i,
+		const char *ext, char *path, size_t len)
+{
+	unsigned int n = i;
+	unsigned int l;
+	size_t pos;
+
+	pos = snprintf(path, len, "%s", config->corpus);
+	for (l = 0; l < config->depth && pos < len; l++)
+	{
+		pos += snprintf(path + pos, len - pos, "/d%02u", n % config->fanout);
+		n /= config->fanout;
+	}
+	snprintf(path + pos, len - pos, "/%08u.%s", i, ext);
+}
+
+static int bench_write(const char *path, const char *data, size_t size)
+{
+	FILE *f;
+	int ret;
+
+	f = fopen(path, "w");
+	if (!f) return 0;
+	ret = fwrite(data, 1, size, f) == size;
+	fclose(f);
+
+	return ret;
+}
+
+static int bench_read(const char *path, char **data, size_t *size)
+{
+	struct stat st;
+	FILE *f;
+	int ret;
+
+	if (stat(path, &st) < 0 || !st.st_size) return 0;
+	f = fopen(path, "r");
+	if (!f) return 0;
+	*data = malloc(st.st_size);
+	*size = st.st_size;
+	ret = fread(*data, 1, *size, f) == *size;
+	fclose(f);
+
+	return ret;
+}
+
+static int bench_encode(BenchTemplate *t, unsigned int buffers,
+		const char *location)
+{
+	GstElement *pipeline;
+	GstMessage *msg;
+	GstBus *bus;
+	GError *err = NULL;
+	gchar *desc;
+	int ret = 0;
+
+	desc = g_strdup_printf(t->pipeline, buffers, location);
+	pipeline = gst_parse_launch(desc, &err);
+	g_free(desc);
+	if (err)
+	{
+		printf("can not encode %s: %s\n", t->ext, err->message);
+		g_error_free(err);
+		if (pipeline) gst_object_unref(pipeline);
+		return 0;
+	}
+	bus = gst_element_get_bus(pipeline);
+	gst_element_set_state(pipeline, GST_STATE_PLAYING);
+	msg = gst_bus_timed_pop_filtered(bus, BENCH_ENCODE_TIMEOUT * GST_SECOND,
+			GST_MESSAGE_EOS | GST_MESSAGE_ERROR);
+	if (msg)
+	{
+		ret = GST_MESSAGE_TYPE(msg) == GST_MESSAGE_EOS;
+		gst_message_unref(msg);
+	}
+	gst_element_set_state(pipeline, GST_STATE_NULL);
+	gst_object_unref(bus);
+	gst_object_unref(pipeline);
+
+	return ret;
+}
+
+/* Encode every template the installed plugins can and copy them over the
+ * tree, interleaved with text files, random data and empty files
+ */
+static int bench_corpus(BenchConfig *config, FILE *out)
+{
+	BenchTemplate *templates[BENCH_TEMPLATES];
+	char path[PATH_MAX];
+	char *junk;
+	unsigned int num = 0;
+	unsigned int i;
+
+	snprintf(path, sizeof(path), "%s-templates/", config->corpus);
+	if (!bench_mkdirs(path))
+	{
+		fprintf(out, "could not create %s\n", path);
+		return 0;
+	}
+	for (i = 0; i < BENCH_TEMPLATES; i++)
+	{
+		BenchTemplate *t = &_templates[i];
+
+		snprintf(path, sizeof(path), "%s-templates/template.%s",
+				config->corpus, t->ext);
+		if (!bench_encode(t, config->buffers, path) ||
+				!bench_read(path, &t->data, &t->size))
+		{
+			fprintf(out, "skipping the %s files\n", t->ext);
+			continue;
+		}
+		templates[num++] = t;
+	}
+	if (!num && config->media)
+	{
+		fprintf(out, "no media file could be encoded\n");
+		return 0;
+	}
+
+	junk = malloc(65536);
+	for (i = 0; i < 65536; i++)
+		junk[i] = random();
+	for (i = 0; i < config->media + config->junk; i++)
+	{
+		const char *ext;
+		const char *data;
+		size_t size;
+
+		/* the media and the junk files are mixed on every directory */
+		if (config->junk && (!config->media ||
+				(uint64_t)i * config->junk / (config->media + config->junk) !=
+				(uint64_t)(i + 1) * config->junk / (config->media + config->junk)))
+		{
+			switch (i % 3)
+			{
+				case 0:
+				ext = "txt";
+				data = "this is not a media file\n";
+				size = strlen(data);
+				break;
+
+				case 1:
+				ext = "bin";
+				data = junk;
+				size = 1 + random() % 65536;
+				break;
+
+				default:
+				ext = "nfo";
+				data = "";
+				size = 0;
+				break;
+			}
+		}
+		else
+		{
+			BenchTemplate *t = templates[i % num];
+
+			ext = t->ext;
+			data = t->data;
+			size = t->size;
+		}
+		bench_file_path(config, i, ext, path, sizeof(path));
+		if (!bench_mkdirs(path) || !bench_write(path, data, size))
+		{
+			fprintf(out, "could not write %s\n", path);
+			free(junk);
+			return 0;
+		}
+	}
+	free(junk);
+
+	return 1;
+}
+
+static void bench_report(FILE *out, const char *name, dmxfs_scan_stats *stats,
+		BenchSql *sql, uint64_t total, uint64_t bytes)
+{
+	double secs = total / 1e9;
+
+	fprintf(out, "%s: %u files (%u media) in %u dirs, %.2f secs, %.1f files/s\n",
+			name, stats->files, stats->media, stats->dirs, secs,
+			secs > 0 ? stats->files / secs : 0);
+	fprintf(out, "  %-8s %10.3f secs %6.1f%%\n", "walk", stats->walk / 1e9,
+			total ? stats->walk * 100.0 / total : 0);
+	fprintf(out, "  %-8s %10.3f secs %6.1f%%\n", "check", stats->check / 1e9,
+			total ? stats->check * 100.0 / total : 0);
+	fprintf(out, "  %-8s %10.3f secs %6.1f%%\n", "probe", stats->probe / 1e9,
+			total ? stats->probe * 100.0 / total : 0);
+	fprintf(out, "  %-8s %10.3f secs %6.1f%%\n", "caps", stats->caps / 1e9,
+			total ? stats->caps * 100.0 / total : 0);
+	fprintf(out, "  %-8s %10.3f secs %6.1f%%, %u statements\n", "sqlite",
+			sql->time / 1e9, total ? sql->time * 100.0 / total : 0,
+			sql->statements);
+	fprintf(out, "  %-8s %10llu bytes\n", "read", (unsigned long long)bytes);
+}
+
+/* scan the whole corpus, as the scanner thread does */
+static void bench_scan(dmxfs_scanner *s, FILE *out, const char *name)
+{
+	BenchSql sql;
+	uint64_t start;
+	uint64_t rchar;
+
+	memset(&sql, 0, sizeof(sql));
+	memset(&s->stats, 0, sizeof(dmxfs_scan_stats));
+	sqlite3_trace_v2(dmxfs_db(s->mfs), SQLITE_TRACE_PROFILE, _sql_profile, &sql);
+	rchar = bench_rchar();
+	start = bench_now();
+	scan_dir(s, s->root->path);
+	bench_report(out, name, &s->stats, &sql, bench_now() - start,
+			bench_rchar() - rchar);
+	sqlite3_trace_v2(dmxfs_db(s->mfs), 0, NULL, NULL);
+}
+
+static void bench_usage(void)
+{
+	printf("Usage:\n");
+	printf("dmxfs-bench-scan [options]\n");
+	printf("\n");
+	printf("    -C DIR        corpus, generated when it does not exist (%s)\n",
+			BENCH_CORPUS_PATH);
+	printf("    -d FILE       database to create (%s)\n", BENCH_DB_PATH);
+	printf("    -m N          number of media files (1000)\n");
+	printf("    -j N          number of files that are not media (500)\n");
+	printf("    -D N          depth of the directory tree (4)\n");
+	printf("    -F N          directories on every level of the tree (4)\n");
+	printf("    -b N          buffers encoded on every media file (50)\n");
+	printf("\n");
+}
+/*============================================================================*
+ *                                 Global                                     *
+ *============================================================================*/
+int main(int argc, char **argv)
+{
+	BenchConfig config;
+	dmxfs_scanner scanner;
+	struct stat st;
+	dmxfs *mfs;
+	FILE *out;
+	int opt;
+	int ret = 1;
+
+	memset(&config, 0, sizeof(config));
+	config.corpus = BENCH_CORPUS_PATH;
+	config.dbpath = BENCH_DB_PATH;
+	config.media = 1000;
+	config.junk = 500;
+	config.depth = 4;
+	config.fanout = 4;
+	config.buffers = 50;
+
+	while ((opt = getopt(argc, argv, "C:d:m:j:D:F:b:h")) != -1)
+	{
+		switch (opt)
+		{
+			case 'C': config.corpus = optarg; break;
+			case 'd': config.dbpath = optarg; break;
+			case 'm': config.media = strtoul(optarg, NULL, 10); break;
+			case 'j': config.junk = strtoul(optarg, NULL, 10); break;
+			case 'D': config.depth = strtoul(optarg, NULL, 10); break;
+			case 'F': config.fanout = strtoul(optarg, NULL, 10); break;
+			case 'b': config.buffers = strtoul(optarg, NULL, 10); break;
+			default:
+			bench_usage();
+			return opt != 'h';
+		}
+	}
+	if (!config.fanout || !config.buffers)
+	{
+		bench_usage();
+		return 1;
+	}
+
+	out = bench_output();
+	if (!out)
+	{
+		printf("could not redirect the output\n");
+		return 1;
+	}
+
+	gst_init(0, NULL);
+	srandom(1);
+	if (stat(config.corpus, &st) < 0)
+	{
+		uint64_t start = bench_now();
+
+		if (!bench_corpus(&config, out))
+			goto no_corpus;
+		fprintf(out, "generated %u media and %u other files in %.2f secs\n",
+				config.media, config.junk, (bench_now() - start) / 1e9);
+	}
+
+	mfs = calloc(1, sizeof(dmxfs));
+	mfs->basepath = strdup(config.corpus);
+	bench_db_remove(config.dbpath);
+	mfs->dbpath = strdup(config.dbpath);
+	if (!db_setup(mfs))
+	{
+		fprintf(out, "could not setup the database %s\n", config.dbpath);
+		free(mfs->dbpath);
+		mfs->dbpath = NULL;
+		goto end;
+	}
+	cache_init(DMXFS_CACHE_SIZE);
+	node_init();
+	/* the corpus is the only root */
+	memset(&scanner, 0, sizeof(scanner));
+	scanner.mfs = mfs;
+	scanner.root = mfs->roots->data;
+	/* created before, the scans only measure their use */
+	scan_pipelines_get(&scanner);
+
+	bench_scan(&scanner, out, "scan");
+	bench_scan(&scanner, out, "rescan");
+	scan_pipelines_put(&scanner, 1);
+	ret = 0;
+end:
+	dmxfs_free(mfs);
+no_corpus:
+	fclose(out);
+
+	return ret;
+}
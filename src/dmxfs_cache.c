@@ -0,0 +1,310 @@
+#ifdef HAVE_CONFIG_H
+#include "config.h"
+#endif
+
+#include <stdlib.h>
+#include <string.h>
+#include <stdio.h>
+#include <stdint.h>
+#include <pthread.h>
+#include <glib.h>
+#include <sqlite3.h>
+#include "dmxfs.h"
+/*============================================================================*
+ *                                  Local                                     *
+ *============================================================================*/
+/* The results of a readdir only depend on the set of caps, not on the
+ * order they appear on the path, so the entries are keyed by the sorted
+ * cap ids plus the canonical query, if any, and the kind of result. Every
+ * entry is stamped with the index generation it was computed on and is
+ * discarded once the scanner bumps it
+ */
+typedef struct _CacheEntry
+{
+	char *key;
+	unsigned int generation;
+	CacheResult *result;
+	struct _CacheEntry *prev;
+	struct _CacheEntry *next;
+} CacheEntry;
+
+/* The entries are spread on several shards, each one with its own LRU
+ * and lock, so concurrent readdirs of different views rarely contend
+ */
+#define CACHE_SHARDS 16
+
+typedef struct _CacheShard
+{
+	GHashTable *entries;
+	/* most recently used entry first */
+	CacheEntry *head;
+	CacheEntry *tail;
+	pthread_mutex_t lock;
+} CacheShard;
+
+static CacheShard _shards[CACHE_SHARDS];
+static int _initialized = 0;
+static unsigned int _size = 0;
+static unsigned int _generation = 1;
+
+static CacheShard * cache_shard(const char *key)
+{
+	return &_shards[g_str_hash(key) % CACHE_SHARDS];
+}
+
+static int cache_id_cmp(const void *a, const void *b)
+{
+	unsigned int ia = *(const unsigned int *)a;
+	unsigned int ib = *(const unsigned int *)b;
+
+	return ia < ib ? -1 : ia > ib;
+}
+
+static char * cache_key(GList *caps, Query *query, CacheKind kind)
+{
+	GString *key;
+	unsigned int *ids;
+	unsigned int last = 0;
+	GList *l;
+	int num;
+	int i;
+
+	num = g_list_length(caps);
+	ids = malloc(sizeof(unsigned int) * (num + 1));
+	for (l = caps, i = 0; l; l = l->next, i++)
+	{
+		Cap *cap = l->data;
+		ids[i] = cap->id;
+	}
+	qsort(ids, num, sizeof(unsigned int), cache_id_cmp);
+
+	switch (kind)
+	{
+		case CACHE_FILES:
+		key = g_string_new("f");
+		break;
+
+		case CACHE_BUCKETS:
+		key = g_string_new("b");
+		break;
+
+		default:
+		key = g_string_new("c");
+		break;
+	}
+	for (i = 0; i < num; i++)
+	{
+		/* the same cap twice on the path is still the same set */
+		if (i && ids[i] == last)
+			continue;
+		g_string_append_printf(key, ":%u", ids[i]);
+		last = ids[i];
+	}
+	free(ids);
+	if (query)
+	{
+		char *qkey;
+
+		qkey = query_key(query);
+		g_string_append_printf(key, "?%s", qkey);
+		g_free(qkey);
+	}
+
+	return g_string_free(key, FALSE);
+}
+
+static void cache_entry_unlink(CacheShard *shard, CacheEntry *e)
+{
+	if (e->prev) e->prev->next = e->next;
+	else shard->head = e->next;
+	if (e->next) e->next->prev = e->prev;
+	else shard->tail = e->prev;
+	e->prev = e->next = NULL;
+}
+
+static void cache_entry_link(CacheShard *shard, CacheEntry *e)
+{
+	e->prev = NULL;
+	e->next = shard->head;
+	if (shard->head) shard->head->prev = e;
+	shard->head = e;
+	if (!shard->tail) shard->tail = e;
+}
+
+static void cache_entry_free(CacheEntry *e)
+{
+	cache_result_unref(e->result);
+	g_free(e->key);
+	free(e);
+}
+
+/* must be called with the shard lock held */
+static void cache_entry_remove(CacheShard *shard, CacheEntry *e)
+{
+	cache_entry_unlink(shard, e);
+	g_hash_table_remove(shard->entries, e->key);
+	cache_entry_free(e);
+}
+/*============================================================================*
+ *                                 Global                                     *
+ *============================================================================*/
+CacheResult * cache_result_new(unsigned int count)
+{
+	CacheResult *r;
+
+	r = malloc(sizeof(CacheResult) + sizeof(unsigned int) * count);
+	r->ref = 1;
+	r->count = 0;
+	r->size = count;
+
+	return r;
+}
+
+/**
+ * Add @id at the end of a result that is not shared yet, the result might
+ * be moved so the returned one must be used instead
+ */
+CacheResult * cache_result_append(CacheResult *r, unsigned int id)
+{
+	if (r->count == r->size)
+	{
+		r->size = r->size ? r->size * 2 : 16;
+		r = realloc(r, sizeof(CacheResult) + sizeof(unsigned int) * r->size);
+	}
+	r->ids[r->count++] = id;
+
+	return r;
+}
+
+CacheResult * cache_result_ref(CacheResult *r)
+{
+	__sync_fetch_and_add(&r->ref, 1);
+	return r;
+}
+
+void cache_result_unref(CacheResult *r)
+{
+	if (__sync_sub_and_fetch(&r->ref, 1) == 0)
+		free(r);
+}
+
+/**
+ * Get the cached result for the set of @caps and @query, the returned
+ * result must be released with cache_result_unref()
+ */
+CacheResult * cache_get(GList *caps, Query *query, CacheKind kind)
+{
+	CacheShard *shard;
+	CacheEntry *e;
+	CacheResult *r = NULL;
+	char *key;
+
+	if (!_initialized) return NULL;
+
+	key = cache_key(caps, query, kind);
+	shard = cache_shard(key);
+	pthread_mutex_lock(&shard->lock);
+	e = g_hash_table_lookup(shard->entries, key);
+	if (e)
+	{
+		if (e->generation != index_generation_get())
+		{
+			cache_entry_remove(shard, e);
+		}
+		else
+		{
+			cache_entry_unlink(shard, e);
+			cache_entry_link(shard, e);
+			r = cache_result_ref(e->result);
+		}
+	}
+	pthread_mutex_unlock(&shard->lock);
+	g_free(key);
+
+	return r;
+}
+
+/**
+ * Store the result for the set of @caps. @generation must be the index
+ * generation read before the result was fetched from the database
+ */
+void cache_set(GList *caps, Query *query, CacheKind kind, CacheResult *r,
+		unsigned int generation)
+{
+	CacheShard *shard;
+	CacheEntry *e;
+	CacheEntry *old;
+
+	if (!_initialized) return;
+	/* the index changed while we were querying it */
+	if (generation != index_generation_get()) return;
+
+	e = calloc(1, sizeof(CacheEntry));
+	e->key = cache_key(caps, query, kind);
+	e->generation = generation;
+	e->result = cache_result_ref(r);
+
+	shard = cache_shard(e->key);
+	pthread_mutex_lock(&shard->lock);
+	old = g_hash_table_lookup(shard->entries, e->key);
+	if (old) cache_entry_remove(shard, old);
+	g_hash_table_insert(shard->entries, e->key, e);
+	cache_entry_link(shard, e);
+	/* evict the least recently used */
+	while (g_hash_table_size(shard->entries) > _size)
+		cache_entry_remove(shard, shard->tail);
+	pthread_mutex_unlock(&shard->lock);
+}
+
+unsigned int index_generation_get(void)
+{
+	return __sync_fetch_and_add(&_generation, 0);
+}
+
+/**
+ * Called whenever the index changes, every cached result becomes stale
+ */
+void index_generation_bump(void)
+{
+	__sync_fetch_and_add(&_generation, 1);
+}
+
+int cache_init(unsigned int size)
+{
+	int i;
+
+	for (i = 0; i < CACHE_SHARDS; i++)
+	{
+		CacheShard *shard = &_shards[i];
+
+		shard->entries = g_hash_table_new(g_str_hash, g_str_equal);
+		shard->head = shard->tail = NULL;
+		pthread_mutex_init(&shard->lock, NULL);
+	}
+	/* the size is split between the shards */
+	_size = size / CACHE_SHARDS;
+	if (!_size) _size = 1;
+	_initialized = 1;
+
+	return 1;
+}
+
+void cache_shutdown(void)
+{
+	int i;
+
+	if (!_initialized) return;
+	_initialized = 0;
+	for (i = 0; i < CACHE_SHARDS; i++)
+	{
+		CacheShard *shard = &_shards[i];
+
+		pthread_mutex_lock(&shard->lock);
+		while (shard->tail)
+			cache_entry_remove(shard, shard->tail);
+		g_hash_table_destroy(shard->entries);
+		shard->entries = NULL;
+		pthread_mutex_unlock(&shard->lock);
+		pthread_mutex_destroy(&shard->lock);
+	}
+}
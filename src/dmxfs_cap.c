@@ -5,22 +5,118 @@
 #include <stdlib.h>
 #include <string.h>
 #include <stdio.h>
+#include <stdint.h>
+#include <pthread.h>
 #include <glib.h>
 #include <sqlite3.h>
 #include "dmxfs.h"
 /*============================================================================*
  *                                  Local                                     *
  *============================================================================*/
+/* The caps vocabulary is small, so every cap is interned on a dictionary
+ * keyed by name and by id. The dictionary owns the caps, whatever is
+ * returned by the functions below must not be freed
+ */
+static GHashTable *_caps_by_name = NULL;
+static GHashTable *_caps_by_id = NULL;
+/* The caps destroyed while mounted, keyed by name. A node or a query might
+ * still point to them, so they are kept until shutdown and get their id
+ * back when the cap is found again
+ */
+static GHashTable *_caps_retired = NULL;
+static pthread_rwlock_t _caps_lock = PTHREAD_RWLOCK_INITIALIZER;
+
 static Cap * cap_new(unsigned int id, const char *name)
 {
 	Cap *cap;
 
-	cap = malloc(sizeof(Cap));
+	cap = calloc(1, sizeof(Cap));
 	cap->id = id;
 	cap->name = strdup(name);
 
 	return cap;
 }
+
+/* must be called with the write lock held */
+static Cap * cap_intern(unsigned int id, const char *name)
+{
+	Cap *cap;
+
+	cap = g_hash_table_lookup(_caps_by_id, GUINT_TO_POINTER(id));
+	if (cap) return cap;
+
+	cap = g_hash_table_lookup(_caps_retired, name);
+	if (cap && cap->id == id)
+		g_hash_table_steal(_caps_retired, name);
+	else
+		cap = cap_new(id, name);
+	g_hash_table_insert(_caps_by_name, cap->name, cap);
+	g_hash_table_insert(_caps_by_id, GUINT_TO_POINTER(cap->id), cap);
+
+	return cap;
+}
+
+static Cap * cap_lookup(GHashTable *table, gconstpointer key)
+{
+	Cap *cap;
+
+	pthread_rwlock_rdlock(&_caps_lock);
+	cap = g_hash_table_lookup(table, key);
+	pthread_rwlock_unlock(&_caps_lock);
+
+	return cap;
+}
+
+static int cap_dictionary_load(sqlite3 *db)
+{
+	sqlite3_stmt *stmt;
+	const char *tail;
+	int error;
+
+	error = sqlite3_prepare(db, "SELECT id, name, files FROM caps;", -1, &stmt, &tail);
+	if (error != SQLITE_OK)
+	{
+		DMXFS_ERR(LOG_DB, "Error loading the caps: %s", sqlite3_errmsg(db));
+		return 0;
+	}
+	pthread_rwlock_wrlock(&_caps_lock);
+	while (sqlite3_step(stmt) == SQLITE_ROW)
+	{
+		Cap *cap;
+
+		cap = cap_intern(sqlite3_column_int(stmt, 0),
+				(const char *)sqlite3_column_text(stmt, 1));
+		cap->files = sqlite3_column_int(stmt, 2);
+	}
+	sqlite3_finalize(stmt);
+	/* the files of the hidden roots are not counted */
+	if (file_roots_hidden())
+	{
+		char *str;
+
+		str = sqlite3_mprintf("SELECT filecaps.cap, COUNT(*) FROM filecaps "
+				"INNER JOIN files ON files.id = filecaps.file "
+				"WHERE files.root IN (%s) GROUP BY filecaps.cap;",
+				file_roots_hidden());
+		if (sqlite3_prepare(db, str, -1, &stmt, &tail) == SQLITE_OK)
+		{
+			while (sqlite3_step(stmt) == SQLITE_ROW)
+			{
+				Cap *cap;
+
+				cap = g_hash_table_lookup(_caps_by_id,
+						GUINT_TO_POINTER(sqlite3_column_int(stmt, 0)));
+				if (cap)
+					cap->files -= sqlite3_column_int(stmt, 1);
+			}
+			sqlite3_finalize(stmt);
+		}
+		sqlite3_free(str);
+	}
+	pthread_rwlock_unlock(&_caps_lock);
+
+	return 1;
+}
 /*============================================================================*
  *                                 Global                                     *
  *============================================================================*/
@@ -30,27 +126,69 @@ void cap_free(Cap *cap)
 	free(cap);
 }
 
-void cap_destroy(Cap *cap, sqlite3 *db)
+/**
+ * Remove @cap from the index once no file has it, returns whether it was
+ * removed. The cap is not freed, see _caps_retired
+ */
+int cap_destroy(Cap *cap, sqlite3 *db)
 {
+	char *str;
+	uint64_t start;
+	int error;
+
+	start = metrics_now();
+	str = sqlite3_mprintf("DELETE FROM caps WHERE id = %u AND NOT EXISTS "
+			"(SELECT 1 FROM filecaps WHERE cap = %u);", cap->id, cap->id);
+	error = sqlite3_exec(db, str, NULL, NULL, NULL);
+	sqlite3_free(str);
+	metrics_observe(METRIC_DB_CAP_DESTROY, start);
+	if (error != SQLITE_OK)
+	{
+		DMXFS_ERR(LOG_DB, "Error destroying the cap %s: %s", cap->name,
+				sqlite3_errmsg(db));
+		return 0;
+	}
+	if (!sqlite3_changes(db))
+		return 0;
+
+	pthread_rwlock_wrlock(&_caps_lock);
+	g_hash_table_remove(_caps_by_name, cap->name);
+	g_hash_table_steal(_caps_by_id, GUINT_TO_POINTER(cap->id));
+	g_hash_table_insert(_caps_retired, cap->name, cap);
+	cap->files = 0;
+	pthread_rwlock_unlock(&_caps_lock);
 
+	return 1;
 }
 
 Cap * cap_new_from_name(sqlite3 *db, const char *name)
 {
+	uint64_t start;
 	Cap *cap = NULL;
-	sqlite3_stmt *stmt;
+	sqlite3_stmt *stmt = NULL;
 	char *str;
 	const char *tail;
 	int error;
 	int id;
 
-	str = sqlite3_mprintf("INSERT OR IGNORE INTO caps (name) VALUES ('%q');",
-			name);
+	cap = cap_lookup(_caps_by_name, name);
+	if (cap) return cap;
+
+	start = metrics_now();
+	/* a destroyed cap found again keeps its id */
+	cap = cap_lookup(_caps_retired, name);
+	if (cap)
+		str = sqlite3_mprintf("INSERT OR IGNORE INTO caps (id, name) VALUES (%u, '%q');",
+				cap->id, name);
+	else
+		str = sqlite3_mprintf("INSERT OR IGNORE INTO caps (name) VALUES ('%q');",
+				name);
+	cap = NULL;
 	error = sqlite3_prepare(db, str, -1, &stmt, &tail);
 	sqlite3_free(str);
 	if (error != SQLITE_OK)
 	{
-		printf("1 error caps %s\n", name);
+		DMXFS_ERR(LOG_DB, "1 error caps %s", name);
 		goto end;
 	}
 	sqlite3_step(stmt);
@@ -62,7 +200,7 @@ Cap * cap_new_from_name(sqlite3 *db, const char *name)
 	sqlite3_free(str);
 	if (error != SQLITE_OK)
 	{
-		printf("1 error caps %s\n", name);
+		DMXFS_ERR(LOG_DB, "1 error caps %s", name);
 		goto end;
 	}
 	if (sqlite3_step(stmt) != SQLITE_ROW)
@@ -70,28 +208,59 @@ Cap * cap_new_from_name(sqlite3 *db, const char *name)
 		goto end;
 	}
 	id = sqlite3_column_int(stmt, 0);
-	cap = cap_new(id, name);
+	pthread_rwlock_wrlock(&_caps_lock);
+	cap = cap_intern(id, name);
+	pthread_rwlock_unlock(&_caps_lock);
 end:
 	sqlite3_finalize(stmt);
+	metrics_observe(METRIC_DB_CAP_NEW_FROM_NAME, start);
 
 	return cap;
 
 }
 
 /**
- * Given a list of names return the caps found on the database
- * that are different from the provided names
+ * Given a list of names return the ids of the caps found on the database
+ * that are different from the provided names. With a @query only the
+ * caps of the files matching it are returned
  */
-GList * cap_get_different_from_caps(sqlite3 *db, GList *caps)
+CacheResult * cap_get_different_from_caps(sqlite3 *db, GList *caps, Query *query)
 {
-	GList *ret = NULL;
+	uint64_t start;
+	CacheResult *ret;
 	sqlite3_stmt *stmt;
 	const char *tail;
 	int error;
-	char *query;
+	char *hidden;
 	char *str;
 
-	if (caps)
+	start = metrics_now();
+	/* the caps only the files of the hidden roots have are not listed */
+	if (file_roots_hidden())
+		hidden = sqlite3_mprintf(" AND filecaps.file NOT IN "
+				"(SELECT id FROM files WHERE root IN (%s))",
+				file_roots_hidden());
+	else
+		hidden = sqlite3_mprintf("");
+	if (query)
+	{
+		GList *l;
+		char *set;
+		char *tmp;
+
+		set = query_to_sql(query, caps);
+		str = sqlite3_mprintf("SELECT DISTINCT caps.id, caps.name FROM caps, filecaps WHERE filecaps.cap = caps.id AND filecaps.file IN (%s)%s", set, hidden);
+		sqlite3_free(set);
+		for (l = caps; l; l = l->next)
+		{
+			Cap *cap = l->data;
+
+			tmp = sqlite3_mprintf("%s AND caps.id != %d", str, cap->id);
+			sqlite3_free(str);
+			str = tmp;
+		}
+	}
+	else if (caps)
 	{
 		Cap *cap = caps->data;
 		GList *l = caps;
@@ -116,7 +285,7 @@ GList * cap_get_different_from_caps(sqlite3 *db, GList *caps)
 		sqlite3_free(substr);
 		substr = tmp;
 
-		str = sqlite3_mprintf("SELECT DISTINCT caps.id, caps.name FROM caps, filecaps, (%s) WHERE filecaps.cap = caps.id AND filecaps.file = f", substr);
+		str = sqlite3_mprintf("SELECT DISTINCT caps.id, caps.name FROM caps, filecaps, (%s) WHERE filecaps.cap = caps.id AND filecaps.file = f%s", substr, hidden);
 		sqlite3_free(substr);
 		for (l = caps; l; l = l->next)
 		{
@@ -126,15 +295,23 @@ GList * cap_get_different_from_caps(sqlite3 *db, GList *caps)
 			str = tmp;
 		}
 	}
+	else if (file_roots_hidden())
+	{
+		str = sqlite3_mprintf("SELECT id, name FROM caps WHERE EXISTS "
+				"(SELECT 1 FROM filecaps WHERE filecaps.cap = caps.id%s)",
+				hidden);
+	}
 	else
 	{
 		str = sqlite3_mprintf("SELECT id, name FROM caps");
 	}
-	printf("cap query = %s\n", str);
+	sqlite3_free(hidden);
+	DMXFS_DBG(LOG_DB, "cap query = %s", str);
+	ret = cache_result_new(0);
 	error = sqlite3_prepare(db, str, -1, &stmt, &tail);
 	if (error != SQLITE_OK)
 	{
-		printf("Error on the query fetching caps %s\n", str);
+		DMXFS_ERR(LOG_DB, "Error on the query fetching caps %s", str);
 		goto end;
 	}
 	while (sqlite3_step(stmt) == SQLITE_ROW)
@@ -144,13 +321,20 @@ GList * cap_get_different_from_caps(sqlite3 *db, GList *caps)
 		unsigned int id;
 
 		id = sqlite3_column_int(stmt, 0);
-		name = sqlite3_column_text(stmt, 1);
-		cap = cap_new(id, name);
-		ret = g_list_append(ret, cap);
+		cap = cap_get_from_id(id);
+		if (!cap)
+		{
+			name = sqlite3_column_text(stmt, 1);
+			pthread_rwlock_wrlock(&_caps_lock);
+			cap = cap_intern(id, name);
+			pthread_rwlock_unlock(&_caps_lock);
+		}
+		ret = cache_result_append(ret, cap->id);
 	}
 end:
 	if (str) sqlite3_free(str);
 	sqlite3_finalize(stmt);
+	metrics_observe(METRIC_DB_CAP_GET_DIFFERENT_FROM_CAPS, start);
 
 	return ret;
 }
@@ -165,38 +349,103 @@ GList * cap_get_relative(GList *caps)
 	 */
 }
 
-Cap * cap_get_from_name(sqlite3 *db, const char *name)
+/**
+ * Get the caps of the file @file_id sorted by id
+ */
+GList * cap_get_from_file(sqlite3 *db, unsigned int file_id)
 {
-	Cap * cap = NULL;
-	char *str;
+	uint64_t start;
+	GList *ret = NULL;
 	sqlite3_stmt *stmt;
 	const char *tail;
+	char *str;
 	int error;
-	int id = -1;
 
-	str = sqlite3_mprintf("SELECT id FROM caps WHERE name = '%q'", name);
+	start = metrics_now();
+	str = sqlite3_mprintf("SELECT DISTINCT cap FROM filecaps WHERE file = %u ORDER BY cap;",
+			file_id);
 	error = sqlite3_prepare(db, str, -1, &stmt, &tail);
 	sqlite3_free(str);
 	if (error != SQLITE_OK)
 	{
-		printf("Error on the cap_get() query %s\n", name);
-		goto end;
+		DMXFS_ERR(LOG_DB, "Error on the query fetching the caps of %u", file_id);
+		metrics_observe(METRIC_DB_CAP_GET_FROM_FILE, start);
+		return NULL;
 	}
-	if (sqlite3_step(stmt) != SQLITE_ROW)
+	while (sqlite3_step(stmt) == SQLITE_ROW)
 	{
-		printf("Error querying cap id for %s\n", name);
-		goto end;
+		Cap *cap;
+
+		cap = cap_get_from_id(sqlite3_column_int(stmt, 0));
+		if (cap)
+			ret = g_list_append(ret, cap);
 	}
-	id = sqlite3_column_int(stmt, 0);
-	cap = cap_new(id, name);
-end:
 	sqlite3_finalize(stmt);
+	metrics_observe(METRIC_DB_CAP_GET_FROM_FILE, start);
 
-	return cap;
+	return ret;
+}
+
+Cap * cap_get_from_name(const char *name)
+{
+	return cap_lookup(_caps_by_name, name);
+}
+
+Cap * cap_get_from_id(unsigned int id)
+{
+	return cap_lookup(_caps_by_id, GUINT_TO_POINTER(id));
+}
+
+unsigned int cap_count(void)
+{
+	unsigned int count = 0;
+
+	pthread_rwlock_rdlock(&_caps_lock);
+	if (_caps_by_id)
+		count = g_hash_table_size(_caps_by_id);
+	pthread_rwlock_unlock(&_caps_lock);
+
+	return count;
+}
+
+/**
+ * Refresh the number of files of every cap. The counts are maintained by
+ * the database triggers, this only copies them
+ */
+int cap_counters_load(sqlite3 *db)
+{
+	uint64_t start;
+	int ret;
+
+	start = metrics_now();
+	ret = cap_dictionary_load(db);
+	metrics_observe(METRIC_DB_CAP_COUNTERS_LOAD, start);
+
+	return ret;
+}
+
+/**
+ * Add @delta to the number of files of every cap on @caps, the same the
+ * triggers did on the transaction just committed. Cheaper than loading
+ * every count again after each file
+ */
+void cap_counters_add(GList *caps, int delta)
+{
+	GList *l;
+
+	pthread_rwlock_wrlock(&_caps_lock);
+	for (l = caps; l; l = l->next)
+	{
+		Cap *cap = l->data;
+
+		cap->files += delta;
+	}
+	pthread_rwlock_unlock(&_caps_lock);
 }
 
 /**
- * Create the caps database in case it is not created yet
+ * Create the caps database in case it is not created yet and load
+ * every cap into the dictionary
  */
 int cap_init(sqlite3 *db)
 {
@@ -206,15 +455,53 @@ int cap_init(sqlite3 *db)
 
 	error = sqlite3_prepare(db,
 			"CREATE TABLE IF NOT EXISTS "
-			"caps(id INTEGER PRIMARY KEY AUTOINCREMENT, name TEXT UNIQUE);",
+			"caps(id INTEGER PRIMARY KEY AUTOINCREMENT, name TEXT UNIQUE, "
+			"files INTEGER DEFAULT 0);",
 			-1, &stmt, &tail);
 	if (error != SQLITE_OK)
 	{
-		printf("Error creating the caps database: %s\n", sqlite3_errmsg(db));
+		DMXFS_ERR(LOG_DB, "Error creating the caps database: %s", sqlite3_errmsg(db));
 		return 0;
 	}
 	sqlite3_step(stmt);
 	sqlite3_finalize(stmt);
+	/* databases created by previous versions do not have the count, it
+	 * is filled when the counters are created
+	 */
+	error = sqlite3_prepare(db, "ALTER TABLE caps ADD COLUMN files INTEGER DEFAULT 0;",
+			-1, &stmt, &tail);
+	if (error == SQLITE_OK)
+	{
+		sqlite3_step(stmt);
+		sqlite3_finalize(stmt);
+	}
 
-	return 1;
+	_caps_by_name = g_hash_table_new(g_str_hash, g_str_equal);
+	_caps_by_id = g_hash_table_new_full(g_direct_hash, g_direct_equal,
+			NULL, (GDestroyNotify)cap_free);
+	_caps_retired = g_hash_table_new_full(g_str_hash, g_str_equal,
+			NULL, (GDestroyNotify)cap_free);
+
+	return cap_dictionary_load(db);
+}
+
+void cap_shutdown(void)
+{
+	pthread_rwlock_wrlock(&_caps_lock);
+	if (_caps_by_name)
+	{
+		g_hash_table_destroy(_caps_by_name);
+		_caps_by_name = NULL;
+	}
+	if (_caps_by_id)
+	{
+		g_hash_table_destroy(_caps_by_id);
+		_caps_by_id = NULL;
+	}
+	if (_caps_retired)
+	{
+		g_hash_table_destroy(_caps_retired);
+		_caps_retired = NULL;
+	}
+	pthread_rwlock_unlock(&_caps_lock);
 }
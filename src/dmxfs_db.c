@@ -0,0 +1,674 @@
+#ifdef HAVE_CONFIG_H
+#include "config.h"
+#endif
+
+#include <stdlib.h>
+#include <string.h>
+#include <stdio.h>
+#include <stdint.h>
+#include <sys/stat.h>
+#include <pthread.h>
+#include <glib.h>
+#include <sqlite3.h>
+#include "dmxfs.h"
+/*============================================================================*
+ *                                  Local                                     *
+ *============================================================================*/
+/* time to wait for the scanner to release the database lock, in ms */
+#define DMXFS_DB_BUSY_TIMEOUT 5000
+/* pages given back on every step of the incremental vacuum */
+#define DMXFS_GC_VACUUM_PAGES 256
+
+/* add a column to an already existing table, if the column is
+ * already there sqlite will just fail, which is fine
+ */
+static void db_add_column(dmxfs *mfs, const char *table, const char *column)
+{
+	sqlite3_stmt *stmt;
+	const char *tail;
+	char *str;
+	int error;
+
+	str = sqlite3_mprintf("ALTER TABLE %s ADD COLUMN %s;", table, column);
+	error = sqlite3_prepare(mfs->db, str, -1, &stmt, &tail);
+	sqlite3_free(str);
+	if (error != SQLITE_OK)
+		return;
+	sqlite3_step(stmt);
+	sqlite3_finalize(stmt);
+}
+
+static int db_create_files(dmxfs *mfs)
+{
+	sqlite3_stmt *stmt;
+	const char *tail;
+	int error;
+
+	error = sqlite3_prepare(mfs->db,
+			"CREATE TABLE IF NOT EXISTS "
+			"files(id INTEGER PRIMARY KEY AUTOINCREMENT, file TEXT UNIQUE, "
+			"mtime INTEGER, size INTEGER DEFAULT 0, duration INTEGER DEFAULT 0, "
+			"bitrate INTEGER DEFAULT 0, width INTEGER DEFAULT 0, "
+			"height INTEGER DEFAULT 0, root INTEGER DEFAULT 0, "
+			"seen INTEGER DEFAULT 0);",
+			-1, &stmt, &tail);
+	if (error != SQLITE_OK)
+	{
+		DMXFS_ERR(LOG_DB, "Error creating the files database: %s", sqlite3_errmsg(mfs->db));
+		return 0;
+	}
+	sqlite3_step(stmt);
+	sqlite3_finalize(stmt);
+	/* databases created by previous versions only have the mtime */
+	db_add_column(mfs, "files", "size INTEGER DEFAULT 0");
+	db_add_column(mfs, "files", "duration INTEGER DEFAULT 0");
+	db_add_column(mfs, "files", "bitrate INTEGER DEFAULT 0");
+	db_add_column(mfs, "files", "width INTEGER DEFAULT 0");
+	db_add_column(mfs, "files", "height INTEGER DEFAULT 0");
+	/* and no root, those files are always listed */
+	db_add_column(mfs, "files", "root INTEGER DEFAULT 0");
+	db_add_column(mfs, "files", "seen INTEGER DEFAULT 0");
+	/* the collector looks for the files of a root not seen */
+	error = sqlite3_prepare(mfs->db,
+			"CREATE INDEX IF NOT EXISTS files_root ON files(root, seen);",
+			-1, &stmt, &tail);
+	if (error != SQLITE_OK)
+	{
+		DMXFS_ERR(LOG_DB, "Error creating the files index: %s", sqlite3_errmsg(mfs->db));
+		return 0;
+	}
+	sqlite3_step(stmt);
+	sqlite3_finalize(stmt);
+
+	return 1;
+}
+
+static int db_create_roots(dmxfs *mfs)
+{
+	sqlite3_stmt *stmt;
+	const char *tail;
+	int error;
+
+	error = sqlite3_prepare(mfs->db,
+			"CREATE TABLE IF NOT EXISTS "
+			"roots(id INTEGER PRIMARY KEY AUTOINCREMENT, path TEXT UNIQUE, "
+			"generation INTEGER DEFAULT 0);",
+			-1, &stmt, &tail);
+	if (error != SQLITE_OK)
+	{
+		DMXFS_ERR(LOG_DB, "Error creating the roots database: %s", sqlite3_errmsg(mfs->db));
+		return 0;
+	}
+	sqlite3_step(stmt);
+	sqlite3_finalize(stmt);
+	db_add_column(mfs, "roots", "generation INTEGER DEFAULT 0");
+
+	return 1;
+}
+
+static int db_create_filecaps(dmxfs *mfs)
+{
+	sqlite3_stmt *stmt;
+	const char *tail;
+	int error;
+
+	error = sqlite3_prepare(mfs->db,
+			"CREATE TABLE IF NOT EXISTS "
+			"filecaps(id INTEGER PRIMARY KEY AUTOINCREMENT, file INTEGER, cap INTEGER, "
+			"FOREIGN KEY (file) REFERENCES files (id),"
+			"FOREIGN KEY (cap) REFERENCES caps (id));",
+			-1, &stmt, &tail);
+	if (error != SQLITE_OK)
+	{
+		DMXFS_ERR(LOG_DB, "Error creating the filecaps database: %s", sqlite3_errmsg(mfs->db));
+		return 0;
+	}
+	sqlite3_step(stmt);
+	sqlite3_finalize(stmt);
+	/* the files of a cap are always fetched by id order */
+	error = sqlite3_prepare(mfs->db,
+			"CREATE INDEX IF NOT EXISTS filecaps_cap ON filecaps(cap, file);",
+			-1, &stmt, &tail);
+	if (error != SQLITE_OK)
+	{
+		DMXFS_ERR(LOG_DB, "Error creating the filecaps index: %s", sqlite3_errmsg(mfs->db));
+		return 0;
+	}
+	sqlite3_step(stmt);
+	sqlite3_finalize(stmt);
+	/* and the caps of a file are fetched from its extended attributes */
+	error = sqlite3_prepare(mfs->db,
+			"CREATE INDEX IF NOT EXISTS filecaps_file ON filecaps(file, cap);",
+			-1, &stmt, &tail);
+	if (error != SQLITE_OK)
+	{
+		DMXFS_ERR(LOG_DB, "Error creating the filecaps index: %s", sqlite3_errmsg(mfs->db));
+		return 0;
+	}
+	sqlite3_step(stmt);
+	sqlite3_finalize(stmt);
+
+	return 1;
+
+}
+
+/* The number of files and bytes of the index and the number of files of
+ * every cap are kept up to date by triggers, so they can be read without
+ * counting anything. Databases without the counters get them filled once
+ */
+static int db_create_counters(dmxfs *mfs)
+{
+	sqlite3_stmt *stmt;
+	const char *tail;
+	char *err = NULL;
+	int exists = 0;
+	int error;
+
+	error = sqlite3_prepare(mfs->db,
+			"SELECT 1 FROM sqlite_master WHERE type = 'table' AND name = 'counters';",
+			-1, &stmt, &tail);
+	if (error != SQLITE_OK)
+	{
+		DMXFS_ERR(LOG_DB, "Error looking for the counters: %s", sqlite3_errmsg(mfs->db));
+		return 0;
+	}
+	exists = sqlite3_step(stmt) == SQLITE_ROW;
+	sqlite3_finalize(stmt);
+	if (exists)
+		return 1;
+
+	error = sqlite3_exec(mfs->db,
+			"BEGIN;"
+			"CREATE TABLE counters(name TEXT PRIMARY KEY, value INTEGER DEFAULT 0);"
+			"INSERT INTO counters (name, value) SELECT 'files', COUNT(*) FROM files;"
+			"INSERT INTO counters (name, value) SELECT 'bytes', IFNULL(SUM(size), 0) FROM files;"
+			"UPDATE caps SET files = (SELECT COUNT(*) FROM filecaps WHERE filecaps.cap = caps.id);"
+			"CREATE TRIGGER files_insert AFTER INSERT ON files BEGIN "
+			"UPDATE counters SET value = value + 1 WHERE name = 'files'; "
+			"UPDATE counters SET value = value + NEW.size WHERE name = 'bytes'; END;"
+			"CREATE TRIGGER files_delete AFTER DELETE ON files BEGIN "
+			"UPDATE counters SET value = value - 1 WHERE name = 'files'; "
+			"UPDATE counters SET value = value - OLD.size WHERE name = 'bytes'; END;"
+			"CREATE TRIGGER files_size AFTER UPDATE OF size ON files BEGIN "
+			"UPDATE counters SET value = value - OLD.size + NEW.size WHERE name = 'bytes'; END;"
+			"CREATE TRIGGER filecaps_insert AFTER INSERT ON filecaps BEGIN "
+			"UPDATE caps SET files = files + 1 WHERE id = NEW.cap; END;"
+			"CREATE TRIGGER filecaps_delete AFTER DELETE ON filecaps BEGIN "
+			"UPDATE caps SET files = files - 1 WHERE id = OLD.cap; END;"
+			"COMMIT;",
+			NULL, NULL, &err);
+	if (error != SQLITE_OK)
+	{
+		DMXFS_ERR(LOG_DB, "Error creating the counters: %s", err);
+		sqlite3_free(err);
+		sqlite3_exec(mfs->db, "ROLLBACK;", NULL, NULL, NULL);
+		return 0;
+	}
+
+	return 1;
+}
+
+static void _db_close(void *data)
+{
+	sqlite3_close(data);
+}
+
+/* Register the roots given and load every root of the index. The files of
+ * the roots not given this time or not reachable, like a disk that is not
+ * plugged, stay on the index but are not listed
+ */
+static int db_roots_load(dmxfs *mfs)
+{
+	sqlite3_stmt *stmt;
+	const char *tail;
+	GArray *hidden;
+	gchar **paths = NULL;
+	int error;
+	int i;
+
+	/* a prebuilt index already has its roots */
+	if (!mfs->index && mfs->basepath)
+	{
+		paths = g_strsplit(mfs->basepath, ":", -1);
+		for (i = 0; paths[i]; i++)
+		{
+			if (!*paths[i]) continue;
+			if (!db_root_add(mfs->db, paths[i]))
+			{
+				g_strfreev(paths);
+				return 0;
+			}
+		}
+	}
+
+	error = sqlite3_prepare(mfs->db, "SELECT id, path, generation FROM roots ORDER BY id;",
+			-1, &stmt, &tail);
+	if (error != SQLITE_OK)
+	{
+		/* an index built without roots, every file is listed */
+		DMXFS_DBG(LOG_DB, "no roots on the index");
+		g_strfreev(paths);
+		return 1;
+	}
+	hidden = g_array_new(FALSE, FALSE, sizeof(unsigned int));
+	while (sqlite3_step(stmt) == SQLITE_ROW)
+	{
+		dmxfs_root *root;
+		int given = mfs->index;
+
+		root = calloc(1, sizeof(dmxfs_root));
+		root->id = sqlite3_column_int(stmt, 0);
+		root->path = strdup((const char *)sqlite3_column_text(stmt, 1));
+		root->generation = sqlite3_column_int(stmt, 2);
+		for (i = 0; paths && paths[i] && !given; i++)
+			given = !strcmp(paths[i], root->path);
+		root->offline = !given || !root_reachable(root->path);
+		if (given && root->offline)
+			DMXFS_WARN(LOG_SCAN, "the root %s is not reachable, its files "
+					"are not listed", root->path);
+		if (root->offline)
+			g_array_append_val(hidden, root->id);
+		mfs->roots = g_list_append(mfs->roots, root);
+	}
+	sqlite3_finalize(stmt);
+	g_strfreev(paths);
+	file_roots_hide(mfs->db, (unsigned int *)hidden->data, hidden->len);
+	g_array_free(hidden, TRUE);
+
+	return 1;
+}
+
+static int db_free_pages(sqlite3 *db)
+{
+	sqlite3_stmt *stmt;
+	const char *tail;
+	int pages = 0;
+
+	if (sqlite3_prepare(db, "PRAGMA freelist_count;", -1, &stmt, &tail) != SQLITE_OK)
+		return 0;
+	if (sqlite3_step(stmt) == SQLITE_ROW)
+		pages = sqlite3_column_int(stmt, 0);
+	sqlite3_finalize(stmt);
+
+	return pages;
+}
+/*============================================================================*
+ *                                 Global                                     *
+ *============================================================================*/
+/* Every thread uses its own connection, the readers never wait for each
+ * other and with the write-ahead log they do not wait for the scanner
+ * either
+ */
+sqlite3 * dmxfs_db(dmxfs *mfs)
+{
+	sqlite3 *db;
+
+	db = pthread_getspecific(mfs->db_key);
+	if (db) return db;
+
+	if (sqlite3_open_v2(mfs->dbpath, &db, (mfs->index ? SQLITE_OPEN_READONLY :
+			SQLITE_OPEN_READWRITE) | SQLITE_OPEN_NOMUTEX, NULL) != SQLITE_OK)
+	{
+		DMXFS_ERR(LOG_DB, "could not open the db: %s", sqlite3_errmsg(db));
+		sqlite3_close(db);
+		return NULL;
+	}
+	sqlite3_busy_timeout(db, DMXFS_DB_BUSY_TIMEOUT);
+	pthread_setspecific(mfs->db_key, db);
+
+	return db;
+}
+
+/* the id of the root on @path, registered if new, zero on error */
+unsigned int db_root_add(sqlite3 *db, const char *path)
+{
+	sqlite3_stmt *stmt;
+	const char *tail;
+	char *str;
+	int error;
+	unsigned int id = 0;
+
+	str = sqlite3_mprintf("INSERT OR IGNORE INTO roots (path) VALUES ('%q');", path);
+	error = sqlite3_exec(db, str, NULL, NULL, NULL);
+	sqlite3_free(str);
+	if (error != SQLITE_OK)
+	{
+		DMXFS_ERR(LOG_DB, "could not add the root %s: %s", path, sqlite3_errmsg(db));
+		return id;
+	}
+	str = sqlite3_mprintf("SELECT id FROM roots WHERE path = '%q';", path);
+	error = sqlite3_prepare(db, str, -1, &stmt, &tail);
+	sqlite3_free(str);
+	if (error != SQLITE_OK)
+		return id;
+	if (sqlite3_step(stmt) == SQLITE_ROW)
+		id = sqlite3_column_int(stmt, 0);
+	sqlite3_finalize(stmt);
+
+	return id;
+}
+
+int root_reachable(const char *path)
+{
+	struct stat st;
+
+	return stat(path, &st) == 0 && S_ISDIR(st.st_mode);
+}
+
+void root_free(dmxfs_root *root)
+{
+	free(root->path);
+	free(root);
+}
+
+int db_setup(dmxfs *mfs)
+{
+	sqlite3_stmt *stmt;
+	const char *tail;
+	int error;
+	int ret = 0;
+
+	/* we should generate the database here
+	 * in case it already exists, just
+	 * compare mtimes of files
+	 */
+	if (mfs->index)
+	{
+		/* already complete, nothing to create */
+		if (sqlite3_open_v2(mfs->dbpath, &mfs->db, SQLITE_OPEN_READONLY,
+				NULL) != SQLITE_OK)
+		{
+			DMXFS_ERR(LOG_DB, "could not open the index %s", mfs->dbpath);
+			goto end;
+		}
+		if (!cap_init(mfs->db))
+		{
+			DMXFS_ERR(LOG_DB, "could not load the caps of the index");
+			goto end;
+		}
+		goto counters;
+	}
+	if (sqlite3_open(mfs->dbpath, &mfs->db) != SQLITE_OK)
+	{
+		DMXFS_ERR(LOG_DB, "could not open the db");
+		goto end;
+	}
+	/* The pages of the rows removed by the collector are given back little
+	 * by little. The mode only applies to a database without tables yet,
+	 * converting an older one takes a full VACUUM the mount can not wait
+	 * for, dmxfs-index builds them converted
+	 */
+	sqlite3_exec(mfs->db, "PRAGMA auto_vacuum=INCREMENTAL;", NULL, NULL, NULL);
+	error = sqlite3_prepare(mfs->db, "PRAGMA auto_vacuum;", -1, &stmt, &tail);
+	if (error == SQLITE_OK)
+	{
+		/* 2 is incremental */
+		if (sqlite3_step(stmt) == SQLITE_ROW &&
+				sqlite3_column_int(stmt, 0) != 2)
+			DMXFS_INFO(LOG_DB, "%s has no incremental vacuum, the pages "
+					"of the removed files are only reused",
+					mfs->dbpath);
+		sqlite3_finalize(stmt);
+	}
+	error = sqlite3_prepare(mfs->db, "PRAGMA journal_mode=WAL;", -1, &stmt, &tail);
+	if (error == SQLITE_OK)
+	{
+		sqlite3_step(stmt);
+		sqlite3_finalize(stmt);
+	}
+	if (!cap_init(mfs->db))
+	{
+		DMXFS_ERR(LOG_DB, "could not create the caps table");
+		goto end;
+	}
+	if (!db_create_files(mfs))
+	{
+		DMXFS_ERR(LOG_DB, "could not create the files table");
+		goto end;
+	}
+	if (!db_create_filecaps(mfs))
+	{
+		DMXFS_ERR(LOG_DB, "could not create the filecaps table");
+		goto end;
+	}
+	if (!db_create_counters(mfs))
+	{
+		DMXFS_ERR(LOG_DB, "could not create the counters");
+		goto end;
+	}
+	if (!db_create_roots(mfs))
+	{
+		DMXFS_ERR(LOG_DB, "could not create the roots table");
+		goto end;
+	}
+counters:
+	if (!db_roots_load(mfs))
+	{
+		DMXFS_ERR(LOG_DB, "could not load the roots");
+		goto end;
+	}
+	file_counters_load(mfs->db);
+	cap_counters_load(mfs->db);
+	if (pthread_key_create(&mfs->db_key, _db_close))
+	{
+		DMXFS_ERR(LOG_DB, "could not create the db key");
+		goto end;
+	}
+	ret = 1;
+end:
+	/* the connection must not be shared with the threads */
+	sqlite3_close(mfs->db);
+	mfs->db = NULL;
+
+	return ret;
+}
+
+int db_insert_file(sqlite3 *db, const char *file, time_t mtime,
+		off_t size, unsigned int root)
+{
+	char *str;
+	sqlite3_stmt *stmt;
+	const char *tail;
+	uint64_t start;
+	int error;
+	int id = -1;
+
+	start = metrics_now();
+	str = sqlite3_mprintf("INSERT OR IGNORE INTO files (file, mtime, size, root) VALUES ('%q',%lld,%lld,%u);",
+			file, (long long)mtime, (long long)size, root);
+	error = sqlite3_prepare(db, str, -1, &stmt, &tail);
+	sqlite3_free(str);
+	if (error != SQLITE_OK)
+	{
+		DMXFS_ERR(LOG_DB, "1 error file %s", file);
+		goto end;
+	}
+	sqlite3_step(stmt);
+	sqlite3_finalize(stmt);
+	/* the file might be already there but with an older mtime */
+	str = sqlite3_mprintf("UPDATE files SET mtime = %lld, size = %lld, root = %u WHERE file = '%q';",
+			(long long)mtime, (long long)size, root, file);
+	error = sqlite3_prepare(db, str, -1, &stmt, &tail);
+	sqlite3_free(str);
+	if (error != SQLITE_OK)
+	{
+		DMXFS_ERR(LOG_DB, "1 error file %s", file);
+		goto end;
+	}
+	sqlite3_step(stmt);
+	sqlite3_finalize(stmt);
+	/* get the id */
+	str = sqlite3_mprintf("SELECT id FROM files WHERE file = '%q';",
+			file);
+	error = sqlite3_prepare(db, str, -1, &stmt, &tail);
+	sqlite3_free(str);
+	if (error != SQLITE_OK)
+	{
+		DMXFS_ERR(LOG_DB, "error artist %s", file);
+		goto end;
+	}
+	if (sqlite3_step(stmt) != SQLITE_ROW)
+	{
+		DMXFS_ERR(LOG_DB, "error querying id");
+		sqlite3_finalize(stmt);
+		goto end;
+	}
+	id = sqlite3_column_int(stmt, 0);
+	sqlite3_finalize(stmt);
+end:
+	metrics_observe(METRIC_DB_INSERT_FILE, start);
+
+	return id;
+}
+
+void db_insert_filecap(sqlite3 *db, int file_id, int cap_id)
+{
+	uint64_t start;
+	sqlite3_stmt *stmt;
+	char *str;
+	const char *tail;
+	int error;
+	int count;
+
+	start = metrics_now();
+	/* FIXME first check that there's no other row with the same cap and file
+	 * we can handle this with the same constraints of the table
+	 * should we create an "active record" for this too?
+	 */
+	str = sqlite3_mprintf("SELECT COUNT(*) FROM filecaps WHERE file = %d AND cap = %d;",
+			file_id, cap_id);
+	error = sqlite3_prepare(db, str, -1, &stmt, &tail);
+	sqlite3_free(str);
+	if (error != SQLITE_OK)
+	{
+		DMXFS_ERR(LOG_DB, "1 error caps %d %d", file_id, cap_id);
+	}
+	sqlite3_step(stmt);
+	count = sqlite3_column_int(stmt, 0);
+	sqlite3_finalize(stmt);
+	if (count)
+	{
+		DMXFS_DBG(LOG_DB, "already exists");
+		goto end;
+	}
+
+	str = sqlite3_mprintf("INSERT OR IGNORE INTO filecaps (file, cap) VALUES (%d, %d);",
+			file_id, cap_id);
+	error = sqlite3_prepare(db, str, -1, &stmt, &tail);
+	sqlite3_free(str);
+	if (error != SQLITE_OK)
+	{
+		DMXFS_ERR(LOG_DB, "1 error caps %d %d", file_id, cap_id);
+		goto end;
+	}
+	sqlite3_step(stmt);
+	sqlite3_finalize(stmt);
+end:
+	metrics_observe(METRIC_DB_INSERT_FILECAP, start);
+}
+
+/* the caps of a file probed again are replaced, see store_file() */
+void db_delete_filecaps(sqlite3 *db, int file_id)
+{
+	uint64_t start;
+	char *str;
+
+	start = metrics_now();
+	str = sqlite3_mprintf("DELETE FROM filecaps WHERE file = %d;", file_id);
+	if (sqlite3_exec(db, str, NULL, NULL, NULL) != SQLITE_OK)
+		DMXFS_ERR(LOG_DB, "error removing the caps of %d: %s", file_id,
+				sqlite3_errmsg(db));
+	sqlite3_free(str);
+	metrics_observe(METRIC_DB_DELETE_FILECAPS, start);
+}
+
+/* whether @file is new or changed since it was indexed, @id is set to its
+ * id when it is already on the index
+ */
+int db_file_changed(sqlite3 *db, const char *file, time_t mtime,
+		int *id)
+{
+	char *str;
+	sqlite3_stmt *stmt;
+	const char *tail;
+	uint64_t start;
+	time_t dbtime;
+	int error;
+	int ret = 1;
+
+	start = metrics_now();
+	*id = 0;
+	str = sqlite3_mprintf("SELECT id, mtime FROM files WHERE file = '%q'", file);
+	/* check if the file exists if so check the mtime and compare */
+	error = sqlite3_prepare(db, str, -1, &stmt, &tail);
+	sqlite3_free(str);
+	if (error != SQLITE_OK)
+	{
+		DMXFS_ERR(LOG_DB, "1 error file %s", file);
+		goto end;
+	}
+	if (sqlite3_step(stmt) == SQLITE_ROW)
+	{
+		*id = sqlite3_column_int(stmt, 0);
+		dbtime = sqlite3_column_int64(stmt, 1);
+		ret = dbtime < mtime;
+	}
+	sqlite3_finalize(stmt);
+end:
+	metrics_observe(METRIC_DB_FILE_CHANGED, start);
+
+	return ret;
+}
+
+/* give the free pages back to the filesystem, a few on every transaction */
+void db_vacuum(sqlite3 *db)
+{
+	char *str;
+	int pages;
+	int left;
+
+	str = sqlite3_mprintf("PRAGMA incremental_vacuum(%d);", DMXFS_GC_VACUUM_PAGES);
+	pages = db_free_pages(db);
+	while (pages > 0)
+	{
+		if (sqlite3_exec(db, str, NULL, NULL, NULL) != SQLITE_OK)
+			break;
+		left = db_free_pages(db);
+		/* nothing given back, try on the next collection */
+		if (left >= pages)
+			break;
+		pages = left;
+	}
+	sqlite3_free(str);
+}
+
+
+/* stop the scanners and release everything set up by db_setup() */
+void dmxfs_free(dmxfs *mfs)
+{
+	GList *l;
+
+	dmxfs_scan_stop(mfs);
+	for (l = mfs->roots; l; l = l->next)
+		root_free(l->data);
+	g_list_free(mfs->roots);
+	file_roots_hide(NULL, NULL, 0);
+	node_shutdown();
+	cache_shutdown();
+	cap_shutdown();
+	/* the connection of this thread, the rest are closed on thread exit */
+	if (mfs->dbpath)
+	{
+		sqlite3 *db;
+
+		db = pthread_getspecific(mfs->db_key);
+		if (db) sqlite3_close(db);
+		pthread_key_delete(mfs->db_key);
+		free(mfs->dbpath);
+	}
+
+	free(mfs->log);
+	free(mfs->trace);
+	free(mfs->basepath);
+	free(mfs);
+}
@@ -2,115 +2,364 @@
 #include "config.h"
 #endif
 
+#include <stdlib.h>
 #include <string.h>
 #include <stdio.h>
+#include <stdint.h>
+#include <pthread.h>
 #include <glib.h>
 #include <sqlite3.h>
 #include "dmxfs.h"
 /*============================================================================*
  *                                  Local                                     *
  *============================================================================*/
+/* copy of the counters the database triggers maintain */
+static unsigned int _files = 0;
+static uint64_t _bytes = 0;
+static pthread_mutex_t _counters_lock = PTHREAD_MUTEX_INITIALIZER;
+/* the last file written to the index, see file_last_get() */
+static unsigned int _last = 0;
+/* the condition that leaves out the files of the hidden roots and the
+ * list of their ids, set before serving anything, see file_roots_hide()
+ */
+static char *_hidden = NULL;
+static char *_hidden_ids = NULL;
+/* the hidden roots are not scanned, their files never change */
+static unsigned int _hidden_files = 0;
+static uint64_t _hidden_bytes = 0;
+
 static File * file_new(unsigned int id, const char *name)
 {
 	File *cap;
 
-	cap = malloc(sizeof(File));
+	cap = calloc(1, sizeof(File));
 	cap->id = id;
 	cap->name = strdup(name);
 
 	return cap;
 }
-/*============================================================================*
- *                                 Global                                     *
- *============================================================================*/
-void file_free(File *file)
+
+/* every query that returns files selects the same columns */
+#define FILE_COLUMNS "files.id, files.file, files.mtime, files.size, " \
+		"files.duration, files.bitrate, files.width, files.height"
+
+static File * file_new_from_row(sqlite3_stmt *stmt)
 {
-	free(file->name);
-	free(file);
+	File *file;
+
+	file = file_new(sqlite3_column_int(stmt, 0),
+			(const char *)sqlite3_column_text(stmt, 1));
+	file->modtime = sqlite3_column_int64(stmt, 2);
+	file->size = sqlite3_column_int64(stmt, 3);
+	file->duration = sqlite3_column_int(stmt, 4);
+	file->bitrate = sqlite3_column_int(stmt, 5);
+	file->width = sqlite3_column_int(stmt, 6);
+	file->height = sqlite3_column_int(stmt, 7);
+
+	return file;
 }
+/* the names of a page of files are packed on chunks of this size */
+#define FILE_SET_CHUNK_SIZE 16384
 
-GList * file_get_from_caps(sqlite3 *db, GList *caps, int offset, int limit)
+static FileSet * file_set_new(int limit)
 {
-	GList *files = NULL;
-	char *str = NULL;
-	sqlite3_stmt *stmt;
-	const char *tail;
-	int error;
+	FileSet *set;
+
+	set = calloc(1, sizeof(FileSet));
+	/* most of the times a page is full, avoid growing it */
+	set->size = limit > 0 && limit < 1024 ? limit : 1024;
+	set->files = malloc(sizeof(File) * set->size);
+	set->arena = arena_new(FILE_SET_CHUNK_SIZE);
+
+	return set;
+}
+
+static void file_set_add_row(FileSet *set, sqlite3_stmt *stmt)
+{
+	File *file;
+
+	if (set->count == set->size)
+	{
+		set->size *= 2;
+		set->files = realloc(set->files, sizeof(File) * set->size);
+	}
+	file = &set->files[set->count++];
+	file->id = sqlite3_column_int(stmt, 0);
+	file->name = arena_strdup(set->arena,
+			(const char *)sqlite3_column_text(stmt, 1));
+	file->modtime = sqlite3_column_int64(stmt, 2);
+	file->size = sqlite3_column_int64(stmt, 3);
+	file->duration = sqlite3_column_int(stmt, 4);
+	file->bitrate = sqlite3_column_int(stmt, 5);
+	file->width = sqlite3_column_int(stmt, 6);
+	file->height = sqlite3_column_int(stmt, 7);
+}
+
+/* Build the query for the files that have every cap of @caps and match
+ * @query on the id range (@after, @before), selecting @columns
+ */
+static char * file_query(GList *caps, Query *query, const char *columns,
+		unsigned int after, unsigned int before, int limit)
+{
+	char *str;
+	char *range;
 
-	if (caps)
+	/* the upper bound of the id range */
+	if (before)
+		range = sqlite3_mprintf(" AND files.id < %u%s", before,
+				_hidden ? _hidden : "");
+	else
+		range = sqlite3_mprintf("%s", _hidden ? _hidden : "");
+
+	if (query)
+	{
+		char *set;
+
+		/* the set operation gives the ids, the files are then fetched
+		 * in id order from it
+		 */
+		set = query_to_sql(query, caps);
+		str = sqlite3_mprintf("SELECT %s FROM files WHERE files.id > %u%s AND files.id IN (%s) ORDER BY files.id LIMIT %d", columns, after, range, set, limit);
+		sqlite3_free(set);
+	}
+	else if (caps)
 	{
 		Cap *cap = caps->data;
 		GList *l = caps;
 		char *tmp;
-		int count = 1;
 
-		str = sqlite3_mprintf("SELECT files.id, files.file FROM files INNER JOIN filecaps on filecaps.file = files.id AND (filecaps.cap = %d", cap->id);
+		/* walk the (cap, file) index of the first cap in id order and
+		 * check the rest of caps for every file, that way sqlite can
+		 * stop as soon as it has @limit files
+		 */
+		str = sqlite3_mprintf("SELECT %s FROM filecaps INNER JOIN files ON files.id = filecaps.file WHERE filecaps.cap = %d AND filecaps.file > %u%s", columns, cap->id, after, range);
 		for (l = l->next; l; l = l->next)
 		{
 			Cap *cap = l->data;
 
-			tmp = sqlite3_mprintf("%s OR filecaps.cap = %d", str, cap->id);
+			tmp = sqlite3_mprintf("%s AND EXISTS (SELECT 1 FROM filecaps AS c WHERE c.cap = %d AND c.file = files.id)", str, cap->id);
 			sqlite3_free(str);
 			str = tmp;
-			count++;
 		}
-		tmp = sqlite3_mprintf("%s) GROUP BY files.id HAVING COUNT(*) = %d LIMIT %d OFFSET %d", str, count, limit, offset);
+		tmp = sqlite3_mprintf("%s ORDER BY filecaps.file LIMIT %d", str, limit);
 		sqlite3_free(str);
 		str = tmp;
 	}
 	else
 	{
-		str = sqlite3_mprintf("SELECT id, file FROM files LIMIT %d OFFSET %d", limit, offset);
+		str = sqlite3_mprintf("SELECT %s FROM files WHERE files.id > %u%s ORDER BY files.id LIMIT %d", columns, after, range, limit);
 	}
+	sqlite3_free(range);
+
+	return str;
+}
+/*============================================================================*
+ *                                 Global                                     *
+ *============================================================================*/
+/**
+ * Leave out of the listings, the lookups and the counters the files of the
+ * @count roots on @ids, the ones that are not reachable. Must be called
+ * before serving anything and before the counters are loaded, a zero
+ * @count shows every file again
+ */
+void file_roots_hide(sqlite3 *db, const unsigned int *ids, unsigned int count)
+{
+	GString *s;
+	sqlite3_stmt *stmt;
+	const char *tail;
+	char *str;
+	unsigned int i;
+
+	g_free(_hidden);
+	g_free(_hidden_ids);
+	_hidden = NULL;
+	_hidden_ids = NULL;
+	_hidden_files = 0;
+	_hidden_bytes = 0;
+	if (!count) return;
+
+	s = g_string_new("");
+	for (i = 0; i < count; i++)
+		g_string_append_printf(s, "%s%u", i ? "," : "", ids[i]);
+	_hidden_ids = g_string_free(s, FALSE);
+	_hidden = g_strdup_printf(" AND files.root NOT IN (%s)", _hidden_ids);
+
+	str = sqlite3_mprintf("SELECT COUNT(*), COALESCE(SUM(size), 0) FROM files "
+			"WHERE root IN (%s);", _hidden_ids);
+	if (sqlite3_prepare(db, str, -1, &stmt, &tail) == SQLITE_OK)
+	{
+		if (sqlite3_step(stmt) == SQLITE_ROW)
+		{
+			_hidden_files = sqlite3_column_int(stmt, 0);
+			_hidden_bytes = sqlite3_column_int64(stmt, 1);
+		}
+		sqlite3_finalize(stmt);
+	}
+	else
+	{
+		DMXFS_ERR(LOG_DB, "Error counting the hidden files: %s",
+				sqlite3_errmsg(db));
+	}
+	sqlite3_free(str);
+}
+
+/**
+ * The ids of the hidden roots separated by commas, NULL when every root
+ * is shown
+ */
+const char * file_roots_hidden(void)
+{
+	return _hidden_ids;
+}
+
+void file_set_free(FileSet *set)
+{
+	arena_free(set->arena);
+	free(set->files);
+	free(set);
+}
+
+void file_free(File *file)
+{
+	free(file->name);
+	free(file);
+}
+
+/**
+ * Get up to @limit files that have every cap of @caps, match @query and
+ * whose id is greater than @after, ordered by id. Passing the last id
+ * received as @after gives the next page. When @before is not zero only
+ * the files with a smaller id are returned
+ */
+FileSet * file_get_from_caps(sqlite3 *db, GList *caps, Query *query,
+		unsigned int after, unsigned int before, int limit)
+{
+	uint64_t start;
+	FileSet *set;
+	char *str;
+	sqlite3_stmt *stmt;
+	const char *tail;
+	int error;
+
+	start = metrics_now();
+	set = file_set_new(limit);
+	str = file_query(caps, query, FILE_COLUMNS, after, before, limit);
 	error = sqlite3_prepare(db, str, -1, &stmt, &tail);
-	printf("query = %s\n", str);
+	DMXFS_DBG(LOG_DB, "query = %s", str);
 	if (error != SQLITE_OK)
 	{
-		printf("Error on the query %s\n", str);
+		DMXFS_ERR(LOG_DB, "Error on the query %s", str);
 		goto end;
 	}
 	while (sqlite3_step(stmt) == SQLITE_ROW)
+		file_set_add_row(set, stmt);
+end:
+	metrics_observe(METRIC_DB_FILE_GET_FROM_CAPS, start);
+	sqlite3_free(str);
+	sqlite3_finalize(stmt);
+
+	return set;
+}
+
+/**
+ * Same as file_get_from_caps() but only the ids are fetched
+ */
+CacheResult * file_get_ids_from_caps(sqlite3 *db, GList *caps, Query *query,
+		unsigned int after, unsigned int before, int limit)
+{
+	uint64_t start;
+	CacheResult *r;
+	char *str;
+	sqlite3_stmt *stmt;
+	const char *tail;
+	int error;
+
+	start = metrics_now();
+	r = cache_result_new(0);
+	str = file_query(caps, query, "files.id", after, before, limit);
+	error = sqlite3_prepare(db, str, -1, &stmt, &tail);
+	if (error != SQLITE_OK)
 	{
-		File *file;
-		int id;
-		const unsigned char *name;
+		DMXFS_ERR(LOG_DB, "Error on the query %s", str);
+		goto end;
+	}
+	while (sqlite3_step(stmt) == SQLITE_ROW)
+		r = cache_result_append(r, sqlite3_column_int(stmt, 0));
+end:
+	metrics_observe(METRIC_DB_FILE_GET_IDS_FROM_CAPS, start);
+	sqlite3_free(str);
+	sqlite3_finalize(stmt);
+
+	return r;
+}
 
-		id = sqlite3_column_int(stmt, 0);
-		name = sqlite3_column_text(stmt, 1);
-		file = file_new(id, name);
-		files = g_list_append(files, file);
+/**
+ * Get the files of the @count ids on @ids, sorted the same. The ids no
+ * longer on the index are left out
+ */
+FileSet * file_get_from_ids(sqlite3 *db, const unsigned int *ids, int count)
+{
+	uint64_t start;
+	FileSet *set;
+	GString *list;
+	char *str;
+	sqlite3_stmt *stmt;
+	const char *tail;
+	int error;
+	int i;
+
+	start = metrics_now();
+	set = file_set_new(count);
+	if (count <= 0)
+		return set;
+	list = g_string_new("");
+	for (i = 0; i < count; i++)
+		g_string_append_printf(list, "%s%u", i ? "," : "", ids[i]);
+	str = sqlite3_mprintf("SELECT " FILE_COLUMNS " FROM files WHERE id IN (%s)%s ORDER BY id;",
+			list->str, _hidden ? _hidden : "");
+	g_string_free(list, TRUE);
+	error = sqlite3_prepare(db, str, -1, &stmt, &tail);
+	if (error != SQLITE_OK)
+	{
+		DMXFS_ERR(LOG_DB, "Error on the query %s", str);
+		goto end;
 	}
+	while (sqlite3_step(stmt) == SQLITE_ROW)
+		file_set_add_row(set, stmt);
 end:
-	if (str) sqlite3_free(str);
+	metrics_observe(METRIC_DB_FILE_GET_FROM_IDS, start);
+	sqlite3_free(str);
 	sqlite3_finalize(stmt);
 
-	return files;
+	return set;
 }
+
 File * file_get_from_id(sqlite3 *db, unsigned int id)
 {
+	uint64_t start;
 	File *file = NULL;
 	char *str = NULL;
 	sqlite3_stmt *stmt;
 	const char *tail;
-	const char *name;
 	int error;
 
-	str = sqlite3_mprintf("SELECT file FROM files WHERE id = %d;",
-			id);
+	start = metrics_now();
+	str = sqlite3_mprintf("SELECT " FILE_COLUMNS " FROM files WHERE id = %d%s;",
+			id, _hidden ? _hidden : "");
 	error = sqlite3_prepare(db, str, -1, &stmt, &tail);
 	if (error != SQLITE_OK)
 	{
-		printf("Error on the file_get() query %s\n", name);
+		DMXFS_ERR(LOG_DB, "Error on the file_get() query %d", id);
 		goto end;
 	}
 	if (sqlite3_step(stmt) != SQLITE_ROW)
 	{
-		printf("Error querying file id for %s\n", name);
+		DMXFS_DBG(LOG_DB, "no file with id %d", id);
 		goto end;
 	}
-	name = sqlite3_column_text(stmt, 0);
-	file = file_new(id, name);
+	file = file_new_from_row(stmt);
 end:
+	metrics_observe(METRIC_DB_FILE_GET_FROM_ID, start);
 	if (str) sqlite3_free(str);
 	sqlite3_finalize(stmt);
 
@@ -119,6 +368,7 @@ end:
 
 File * file_get_from_name(sqlite3 *db, const char *name)
 {
+	uint64_t start;
 	File *file = NULL;
 	char *str = NULL;
 	sqlite3_stmt *stmt;
@@ -126,24 +376,131 @@ File * file_get_from_name(sqlite3 *db, const char *name)
 	int error;
 	int id;
 
-	str = sqlite3_mprintf("SELECT id FROM files WHERE file = '%q';",
-			name);
+	start = metrics_now();
+	str = sqlite3_mprintf("SELECT id FROM files WHERE file = '%q'%s;",
+			name, _hidden ? _hidden : "");
 	error = sqlite3_prepare(db, str, -1, &stmt, &tail);
 	if (error != SQLITE_OK)
 	{
-		printf("Error on the file_get() query %s\n", name);
+		DMXFS_ERR(LOG_DB, "Error on the file_get() query %s", name);
 		goto end;
 	}
 	if (sqlite3_step(stmt) != SQLITE_ROW)
 	{
-		printf("Error querying file id for %s\n", name);
+		DMXFS_DBG(LOG_DB, "no file named %s", name);
 		goto end;
 	}
 	id = sqlite3_column_int(stmt, 0);
 	file = file_new(id, name);
 end:
+	metrics_observe(METRIC_DB_FILE_GET_FROM_NAME, start);
 	if (str) sqlite3_free(str);
 	sqlite3_finalize(stmt);
 
 	return file;
 }
+
+/**
+ * Refresh the total number of files and bytes from the counters table,
+ * without the hidden ones, and the id of the last file written
+ */
+int file_counters_load(sqlite3 *db)
+{
+	uint64_t start;
+	sqlite3_stmt *stmt;
+	const char *tail;
+	int error;
+
+	start = metrics_now();
+	error = sqlite3_prepare(db, "SELECT name, value FROM counters;",
+			-1, &stmt, &tail);
+	if (error != SQLITE_OK)
+	{
+		DMXFS_ERR(LOG_DB, "Error loading the counters: %s", sqlite3_errmsg(db));
+		metrics_observe(METRIC_DB_FILE_COUNTERS_LOAD, start);
+		return 0;
+	}
+	pthread_mutex_lock(&_counters_lock);
+	while (sqlite3_step(stmt) == SQLITE_ROW)
+	{
+		const char *name = (const char *)sqlite3_column_text(stmt, 0);
+
+		if (!strcmp(name, "files"))
+			_files = sqlite3_column_int(stmt, 1);
+		else if (!strcmp(name, "bytes"))
+			_bytes = sqlite3_column_int64(stmt, 1);
+	}
+	sqlite3_finalize(stmt);
+	_files -= _hidden_files;
+	_bytes -= _hidden_bytes;
+	/* the files are written on a transaction each and the writers wait
+	 * for each other, so every id below the last one is complete. Another
+	 * scanner might have loaded a bigger one meanwhile
+	 */
+	if (sqlite3_prepare(db, "SELECT MAX(id) FROM files;", -1, &stmt,
+			&tail) == SQLITE_OK)
+	{
+		if (sqlite3_step(stmt) == SQLITE_ROW)
+		{
+			unsigned int last = sqlite3_column_int(stmt, 0);
+
+			if (last > _last)
+				__atomic_store_n(&_last, last, __ATOMIC_RELEASE);
+		}
+		sqlite3_finalize(stmt);
+	}
+	pthread_mutex_unlock(&_counters_lock);
+
+	metrics_observe(METRIC_DB_FILE_COUNTERS_LOAD, start);
+	return 1;
+}
+
+void file_counters_get(unsigned int *files, uint64_t *bytes)
+{
+	pthread_mutex_lock(&_counters_lock);
+	if (files) *files = _files;
+	if (bytes) *bytes = _bytes;
+	pthread_mutex_unlock(&_counters_lock);
+}
+
+/**
+ * The id of the last file written to the index. A directory read page by
+ * page pins it on open so the files written later are not listed. It is
+ * not a snapshot, a file probed again keeps its id and might gain or lose
+ * caps meanwhile. Never takes a lock
+ */
+unsigned int file_last_get(void)
+{
+	return __atomic_load_n(&_last, __ATOMIC_ACQUIRE);
+}
+
+/**
+ * Store the stream information found while probing the file
+ */
+int file_set_media_info(sqlite3 *db, unsigned int id, unsigned int duration,
+		unsigned int bitrate, unsigned int width, unsigned int height)
+{
+	uint64_t start;
+	sqlite3_stmt *stmt;
+	const char *tail;
+	char *str;
+	int error;
+
+	start = metrics_now();
+	str = sqlite3_mprintf("UPDATE files SET duration = %u, bitrate = %u, "
+			"width = %u, height = %u WHERE id = %u;",
+			duration, bitrate, width, height, id);
+	error = sqlite3_prepare(db, str, -1, &stmt, &tail);
+	sqlite3_free(str);
+	if (error != SQLITE_OK)
+	{
+		DMXFS_ERR(LOG_DB, "Error updating the media info of file %d", id);
+		metrics_observe(METRIC_DB_FILE_SET_MEDIA_INFO, start);
+		return 0;
+	}
+	sqlite3_step(stmt);
+	sqlite3_finalize(stmt);
+
+	metrics_observe(METRIC_DB_FILE_SET_MEDIA_INFO, start);
+	return 1;
+}
@@ -0,0 +1,1588 @@
+#ifdef HAVE_CONFIG_H
+#include "config.h"
+#endif
+
+#define FUSE_USE_VERSION 312
+#include <fuse_lowlevel.h>
+#include <stddef.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+#include <fcntl.h>
+#include <errno.h>
+#include <limits.h>
+#include <stdint.h>
+#include <sys/statvfs.h>
+#include <sqlite3.h>
+#include <pthread.h>
+#include <glib.h>
+
+#if HAVE_INOTIFY
+#include <sys/inotify.h>
+/* size of the event structure, not counting name */
+#define EVENT_SIZE  (sizeof (struct inotify_event))
+/* reasonable guess as to size of 1024 events */
+#define BUF_LEN        1024 * (EVENT_SIZE + 16)
+#endif
+
+#include "dmxfs.h"
+#include "dmxfs_fuse.h"
+/*============================================================================*
+ *                                  Local                                     *
+ *============================================================================*/
+/* name of a bucket, the first and last ids of its range */
+#define DMXFS_BUCKET_FORMAT "%08u-%08u"
+
+/* an open directory, @r has the entries or is NULL when they are read
+ * page by page from the database
+ */
+typedef struct _dmxfs_dir
+{
+	CacheResult *r;
+	/* the entries of a files directory are buckets */
+	int buckets;
+	/* the last file on the index when opened, the files written after it
+	 * are not listed, see file_last_get()
+	 */
+	unsigned int last;
+} dmxfs_dir;
+
+/* an open file on the regular mode or an open control file */
+typedef struct _dmxfs_handle
+{
+	int fd;
+	/* the kernel reads the file directly when it is positive */
+	int backing_id;
+	/* the contents of a control file, rendered on open */
+	char *data;
+	size_t size;
+} dmxfs_handle;
+
+/******************************************************************************
+ *                                 Replies                                    *
+ ******************************************************************************/
+static const dmxfs_reply _fuse_reply = {
+	.userdata          = fuse_req_userdata,
+	.err               = fuse_reply_err,
+	.none              = fuse_reply_none,
+	.entry             = fuse_reply_entry,
+	.attr              = fuse_reply_attr,
+	.readlink          = fuse_reply_readlink,
+	.open              = fuse_reply_open,
+	.buf               = fuse_reply_buf,
+	.data              = fuse_reply_data,
+	.statfs            = fuse_reply_statfs,
+	.xattr             = fuse_reply_xattr,
+	.add_direntry      = fuse_add_direntry,
+	.add_direntry_plus = fuse_add_direntry_plus,
+};
+
+/* every operation replies through here, see dmxfs_reply_set() */
+static const dmxfs_reply *_reply = &_fuse_reply;
+
+/******************************************************************************
+ *                                Monitor                                     *
+ ******************************************************************************/
+#if HAVE_INOTIFY
+static void * _monitor(void *data)
+{
+#if 0
+	dmxfs *mfs = data;
+
+	printf("starting the monitor\n");
+	mfs->inotify_fd = inotify_init();
+	if (mfs->inotify_fd < 0)
+	{
+		printf("error initializing inotify\n");
+		return NULL;
+	}
+	mfs->inotify_wd = inotify_add_watch(mfs->inotify_fd, mfs->basepath, IN_MODIFY | IN_CREATE | IN_DELETE);
+	//mfs->inotify_wd = inotify_add_watch(mfs->inotify_fd, mfs->basepath, IN_ALL_EVENTS);
+	if (mfs->inotify_wd < 0)
+	{
+		printf("error adding the watch\n");
+		return NULL;
+	}
+	while (1)
+	{
+		char buf[BUF_LEN];
+		int len, i = 0;
+
+		len = read(mfs->inotify_fd, buf, BUF_LEN);
+		while (i < len)
+		{
+			struct inotify_event *event;
+
+		        event = (struct inotify_event *) &buf[i];
+			printf("wd=%d mask=%u cookie=%u len=%u\n",
+        	        	event->wd, event->mask,
+	                	event->cookie, event->len);
+
+        		if (event->len)
+		                printf ("name=%s\n", event->name);
+
+		        i += EVENT_SIZE + event->len;
+		}
+	}
+	//inotify_rm_watch(mfs->inotify_fd, mfs->inotify_wd);
+	//close(mfs->inotify_fd);
+#endif
+}
+
+static void dmxfs_monitor(dmxfs *mfs)
+{
+#if 0
+	int ret;
+	pthread_attr_t attr;
+
+	ret = pthread_attr_init(&attr);
+	if (ret) {
+		perror("pthread_attr_init");
+		return;
+	}
+
+	ret = pthread_create(&mfs->monitor, &attr, _monitor, mfs);
+	if (ret) {
+		perror("pthread_create");
+		return;
+	}
+#endif
+}
+#endif
+
+/******************************************************************************
+ *                                 Control                                    *
+ ******************************************************************************/
+/* The root lists a hidden directory with virtual files that expose the
+ * state of the filesystem, every file is rendered again on each open
+ */
+#define DMXFS_CONTROL_DIR ".dmxfs"
+
+typedef struct _dmxfs_control
+{
+	const char *name;
+	/* the contents of the file, freed with g_free() */
+	char * (*read)(dmxfs *mfs);
+} dmxfs_control;
+
+static void control_metric(GString *s, const char *name, const char *type,
+		const char *help, uint64_t value)
+{
+	g_string_append_printf(s, "# HELP %s %s\n", name, help);
+	g_string_append_printf(s, "# TYPE %s %s\n", name, type);
+	g_string_append_printf(s, "%s %llu\n", name, (unsigned long long)value);
+}
+
+/* a counter of the scanners, one series per root */
+static void control_scan_metric(GString *s, dmxfs *mfs, const char *name,
+		const char *help, size_t offset)
+{
+	GList *l;
+
+	g_string_append_printf(s, "# HELP %s %s\n", name, help);
+	g_string_append_printf(s, "# TYPE %s counter\n", name);
+	for (l = mfs->scanners; l; l = l->next)
+	{
+		dmxfs_scanner *sc = l->data;
+		const char *c;
+
+		g_string_append_printf(s, "%s{root=\"", name);
+		for (c = sc->root->path; *c; c++)
+		{
+			if (*c == '"' || *c == '\\')
+				g_string_append_c(s, '\\');
+			g_string_append_c(s, *c);
+		}
+		g_string_append_printf(s, "\"} %u\n",
+				*(unsigned int *)((char *)&sc->stats + offset));
+	}
+}
+
+/* the latency histograms plus the scanner and index counters on the
+ * Prometheus text format
+ */
+static char * control_metrics_read(dmxfs *mfs)
+{
+	unsigned int files;
+	uint64_t bytes;
+	unsigned int offline = 0;
+	GList *l;
+	GString *s;
+
+	s = g_string_new("");
+	metrics_print(s);
+	control_scan_metric(s, mfs, "dmxfs_scan_dirs_total",
+			"Directories scanned",
+			offsetof(dmxfs_scan_stats, dirs));
+	control_scan_metric(s, mfs, "dmxfs_scan_files_total",
+			"Files scanned",
+			offsetof(dmxfs_scan_stats, files));
+	control_scan_metric(s, mfs, "dmxfs_scan_probed_total",
+			"Files new or changed whose type was probed",
+			offsetof(dmxfs_scan_stats, probed));
+	control_scan_metric(s, mfs, "dmxfs_scan_media_total",
+			"Probed files found to be media",
+			offsetof(dmxfs_scan_stats, media));
+	control_scan_metric(s, mfs, "dmxfs_scan_removed_total",
+			"Files not found anymore and removed from the index",
+			offsetof(dmxfs_scan_stats, removed));
+	for (l = mfs->roots; l; l = l->next)
+	{
+		dmxfs_root *root = l->data;
+
+		if (root->offline) offline++;
+	}
+	/* the walk of a root is recursive, there is no queue of directories,
+	 * the roots still being scanned are the backlog
+	 */
+	control_metric(s, "dmxfs_scan_roots_pending", "gauge",
+			"Roots whose scan is not complete yet",
+			__atomic_load_n(&mfs->scanning, __ATOMIC_ACQUIRE));
+	control_metric(s, "dmxfs_index_roots", "gauge",
+			"Roots on the index", g_list_length(mfs->roots));
+	control_metric(s, "dmxfs_index_roots_offline", "gauge",
+			"Roots on the index whose files are not listed", offline);
+	file_counters_get(&files, &bytes);
+	control_metric(s, "dmxfs_index_files", "gauge",
+			"Files on the index", files);
+	control_metric(s, "dmxfs_index_bytes", "gauge",
+			"Bytes of the files on the index", bytes);
+	control_metric(s, "dmxfs_index_caps", "gauge",
+			"Caps on the index", cap_count());
+
+	return g_string_free(s, FALSE);
+}
+
+/* the spans kept so far, empty unless tracing */
+static char * control_trace_read(dmxfs *mfs)
+{
+	return trace_dump();
+}
+
+static dmxfs_control dmxfs_controls[] = {
+	{ "metrics", control_metrics_read },
+	{ "trace", control_trace_read },
+};
+
+#define DMXFS_CONTROLS (sizeof(dmxfs_controls) / sizeof(dmxfs_control))
+
+static dmxfs_control * control_get(fuse_ino_t ino)
+{
+	unsigned int idx;
+
+	idx = node_ino_to_control(ino);
+	if (idx >= DMXFS_CONTROLS)
+		return NULL;
+	return &dmxfs_controls[idx];
+}
+
+static int control_lookup(const char *name, fuse_ino_t *ino)
+{
+	unsigned int i;
+
+	for (i = 0; i < DMXFS_CONTROLS; i++)
+	{
+		if (!strcmp(dmxfs_controls[i].name, name))
+		{
+			*ino = node_ino_from_control(i);
+			return 1;
+		}
+	}
+	return 0;
+}
+
+/* The size is reported as zero, rendering a file only to measure it
+ * would dump the whole trace on every stat. The contents are rendered
+ * once on open and kept on the handle, and the reads are direct_io so
+ * they are not bounded by the size
+ */
+static void control_stat(fuse_ino_t ino, struct stat *stbuf)
+{
+	memset(stbuf, 0, sizeof(struct stat));
+	stbuf->st_ino = ino;
+	stbuf->st_mode = S_IFREG | 0444;
+	stbuf->st_nlink = 1;
+}
+
+/******************************************************************************
+ *                                   FUSE                                     *
+ ******************************************************************************/
+/* inode number for directory entries the kernel has not looked up yet */
+#define DMXFS_UNKNOWN_INO 0xffffffff
+
+static CacheResult * readdir_subcaps(dmxfs *mfs, Node *node)
+{
+	CacheResult *r;
+	unsigned int generation;
+
+	r = cache_get(node->caps, node->query, CACHE_SUBCAPS);
+	if (r) return r;
+
+	generation = index_generation_get();
+	r = cap_get_different_from_caps(dmxfs_db(mfs), node->caps, node->query);
+	cache_set(node->caps, node->query, CACHE_SUBCAPS, r, generation);
+
+	return r;
+}
+
+static int result_has(CacheResult *r, unsigned int id, int sorted)
+{
+	unsigned int i;
+
+	if (!sorted)
+	{
+		for (i = 0; i < r->count; i++)
+			if (r->ids[i] == id) return 1;
+		return 0;
+	}
+	else
+	{
+		unsigned int lo = 0;
+		unsigned int hi = r->count;
+
+		while (lo < hi)
+		{
+			i = (lo + hi) / 2;
+			if (r->ids[i] == id) return 1;
+			if (r->ids[i] < id) lo = i + 1;
+			else hi = i;
+		}
+		return 0;
+	}
+}
+
+/* Returns NULL when there are too many files to keep them in memory, the
+ * listing is then read in pages directly from the database
+ */
+static CacheResult * readdir_files(dmxfs *mfs, Node *node)
+{
+	CacheResult *r;
+	unsigned int generation;
+
+	r = cache_get(node->caps, node->query, CACHE_FILES);
+	if (r) return r;
+
+	generation = index_generation_get();
+	r = file_get_ids_from_caps(dmxfs_db(mfs), node->caps, node->query, 0, 0,
+			DMXFS_CACHE_MAX_FILES + 1);
+	if (r->count > DMXFS_CACHE_MAX_FILES)
+	{
+		cache_result_unref(r);
+		return NULL;
+	}
+	cache_set(node->caps, node->query, CACHE_FILES, r, generation);
+
+	return r;
+}
+
+/* A files directory with more files than the bucket size lists the
+ * buckets instead, each one being the files on a range of bucket size ids
+ * so a bucket never has more files than that
+ */
+static int readdir_bucketed(dmxfs *mfs, CacheResult *r)
+{
+	return mfs->bucket_size && (!r || r->count > mfs->bucket_size);
+}
+
+/* Only the buckets with files are listed, every one of them is found by
+ * asking for the first file after the end of the previous one
+ */
+static CacheResult * readdir_buckets(dmxfs *mfs, Node *node)
+{
+	CacheResult *r;
+	unsigned int generation;
+	unsigned int after = 0;
+
+	r = cache_get(node->caps, node->query, CACHE_BUCKETS);
+	if (r) return r;
+
+	generation = index_generation_get();
+	r = cache_result_new(0);
+	for (;;)
+	{
+		CacheResult *first;
+		unsigned int bucket;
+
+		first = file_get_ids_from_caps(dmxfs_db(mfs), node->caps,
+				node->query, after, 0, 1);
+		if (!first->count)
+		{
+			cache_result_unref(first);
+			break;
+		}
+		bucket = first->ids[0] / mfs->bucket_size;
+		cache_result_unref(first);
+
+		r = cache_result_append(r, bucket);
+		if ((uint64_t)(bucket + 1) * mfs->bucket_size > UINT_MAX)
+			break;
+		after = (bucket + 1) * mfs->bucket_size - 1;
+	}
+	cache_set(node->caps, node->query, CACHE_BUCKETS, r, generation);
+
+	return r;
+}
+
+/* get the id range of a bucket node, the files directories span every id */
+static void readdir_range(Node *node, unsigned int *first, unsigned int *last)
+{
+	*first = 0;
+	*last = UINT_MAX;
+	if (node->type == NODE_BUCKET)
+		node_bucket_range(node->name, first, last);
+}
+
+/* check that the file @id is listed on the files directory @node */
+static int readdir_files_has(dmxfs *mfs, Node *node, unsigned int id)
+{
+	CacheResult *r;
+	unsigned int first;
+	unsigned int last;
+	int found = 0;
+
+	readdir_range(node, &first, &last);
+	if (id < first || id > last)
+		return 0;
+
+	r = cache_get(node->caps, node->query, CACHE_FILES);
+	if (r)
+	{
+		found = result_has(r, id, 1);
+		cache_result_unref(r);
+		return found;
+	}
+	/* the first file after the previous id must be the file itself */
+	r = file_get_ids_from_caps(dmxfs_db(mfs), node->caps, node->query,
+			id - 1, 0, 1);
+	found = r->count && r->ids[0] == id;
+	cache_result_unref(r);
+
+	return found;
+}
+
+/* check that @name is a bucket of the current bucket size */
+static int bucket_name_valid(dmxfs *mfs, const char *name)
+{
+	unsigned int first;
+	unsigned int last;
+
+	if (!mfs->bucket_size) return 0;
+	if (!node_bucket_range(name, &first, &last)) return 0;
+
+	return !(first % mfs->bucket_size) &&
+			last - first == mfs->bucket_size - 1;
+}
+
+/* files are named by its id, anything else is not a file */
+static int name_to_file_id(const char *name, unsigned int *id)
+{
+	char *end;
+	unsigned long v;
+
+	if (!*name) return 0;
+	v = strtoul(name, &end, 10);
+	if (*end || !v || v > UINT_MAX) return 0;
+	*id = v;
+
+	return 1;
+}
+
+/* The size of a directory is the number of files on its view and the
+ * link count the usual two plus the subdirectories. Both come from the
+ * counters or from an already cached listing, when none of them is
+ * available the size is zero and the link count one, which tells the
+ * tools that the number of subdirectories is unknown
+ */
+static void node_stat(Node *node, struct stat *stbuf)
+{
+	CacheResult *r;
+
+	memset(stbuf, 0, sizeof(struct stat));
+	stbuf->st_ino = node->ino;
+	stbuf->st_mode = S_IFDIR | 0755;
+
+	/* the buckets only have a part of the files of the view */
+	if (node->type == NODE_BUCKET || node->type == NODE_CONTROL)
+	{
+		stbuf->st_nlink = 2;
+		return;
+	}
+
+	if (!node->caps && !node->query)
+	{
+		unsigned int files;
+
+		file_counters_get(&files, NULL);
+		stbuf->st_size = files;
+	}
+	else if (!node->query && !node->caps->next)
+	{
+		Cap *cap = node->caps->data;
+
+		stbuf->st_size = cap->files;
+	}
+	else if ((r = cache_get(node->caps, node->query, CACHE_FILES)))
+	{
+		stbuf->st_size = r->count;
+		cache_result_unref(r);
+	}
+
+	if (node->type == NODE_FILES)
+	{
+		stbuf->st_nlink = 2;
+		if ((r = cache_get(node->caps, node->query, CACHE_BUCKETS)))
+		{
+			stbuf->st_nlink += r->count;
+			cache_result_unref(r);
+		}
+	}
+	else if (!node->caps && !node->query)
+	{
+		/* the root lists the files and control directories and every cap */
+		stbuf->st_nlink = 4 + cap_count();
+	}
+	else if ((r = cache_get(node->caps, node->query, CACHE_SUBCAPS)))
+	{
+		stbuf->st_nlink = 3 + r->count;
+		cache_result_unref(r);
+	}
+	else
+	{
+		stbuf->st_nlink = 1;
+	}
+}
+
+static mode_t file_mode(dmxfs *mfs)
+{
+	return mfs->regular ? S_IFREG | 0444 : S_IFLNK | 0755;
+}
+
+static void file_stat(dmxfs *mfs, File *file, struct stat *stbuf)
+{
+	memset(stbuf, 0, sizeof(struct stat));
+	stbuf->st_ino = node_ino_from_file(file->id);
+	stbuf->st_mode = file_mode(mfs);
+	stbuf->st_nlink = 1;
+	/* report the attributes of the real file so
+	 * nobody needs to follow the link
+	 */
+	stbuf->st_size = file->size;
+	stbuf->st_blocks = (file->size + 511) / 512;
+	stbuf->st_mtime = file->modtime;
+	stbuf->st_ctime = file->modtime;
+	stbuf->st_atime = file->modtime;
+}
+
+static void dmxfs_lookup(fuse_req_t req, fuse_ino_t parent, const char *name)
+{
+	struct fuse_entry_param e;
+	dmxfs *mfs;
+	Node *pnode;
+
+	mfs = _reply->userdata(req);
+	if (node_ino_is_file(parent) || node_ino_is_control(parent))
+	{
+		_reply->err(req, ENOTDIR);
+		return;
+	}
+	pnode = node_get(parent);
+	if (!pnode)
+	{
+		_reply->err(req, ENOENT);
+		return;
+	}
+
+	memset(&e, 0, sizeof(e));
+	if (pnode->type == NODE_CONTROL)
+	{
+		fuse_ino_t ino;
+
+		if (!control_lookup(name, &ino))
+		{
+			_reply->err(req, ENOENT);
+			return;
+		}
+		e.ino = ino;
+		control_stat(ino, &e.attr);
+	}
+	else if (pnode->type == NODE_CAPS)
+	{
+		Node *child;
+
+		if (!strcmp(name, "files"))
+		{
+			child = node_child_ref(pnode, NODE_FILES, NULL, NULL, name);
+		}
+		else if (!pnode->parent && !strcmp(name, DMXFS_CONTROL_DIR))
+		{
+			child = node_child_ref(pnode, NODE_CONTROL, NULL, NULL, name);
+		}
+		else if (query_is_expression(name))
+		{
+			Query *query;
+
+			/* any valid expression is a directory, even if it is not
+			 * listed, its files are the ones matching the expression
+			 * and the caps of the path
+			 */
+			query = query_parse(name, pnode->query);
+			if (!query)
+			{
+				_reply->err(req, ENOENT);
+				return;
+			}
+			child = node_child_ref(pnode, NODE_CAPS, NULL, query, name);
+		}
+		else
+		{
+			CacheResult *r;
+			Cap *cap;
+			int found;
+
+			/* only the caps listed on the parent are valid */
+			cap = cap_get_from_name(name);
+			if (!cap)
+			{
+				_reply->err(req, ENOENT);
+				return;
+			}
+			r = readdir_subcaps(mfs, pnode);
+			found = result_has(r, cap->id, 0);
+			cache_result_unref(r);
+			if (!found)
+			{
+				_reply->err(req, ENOENT);
+				return;
+			}
+			child = node_child_ref(pnode, NODE_CAPS, cap, NULL, name);
+		}
+		e.ino = child->ino;
+		node_stat(child, &e.attr);
+	}
+	else if (pnode->type == NODE_FILES && bucket_name_valid(mfs, name))
+	{
+		Node *child;
+
+		child = node_child_ref(pnode, NODE_BUCKET, NULL, NULL, name);
+		e.ino = child->ino;
+		node_stat(child, &e.attr);
+	}
+	else
+	{
+		File *file;
+		unsigned int id;
+
+		/* the files are still found on a bucketed directory, the kernel
+		 * might have their entries from before it was split
+		 */
+		if (!name_to_file_id(name, &id))
+		{
+			_reply->err(req, ENOENT);
+			return;
+		}
+		if (!readdir_files_has(mfs, pnode, id) ||
+				!(file = file_get_from_id(dmxfs_db(mfs), id)))
+		{
+			_reply->err(req, ENOENT);
+			return;
+		}
+		e.ino = node_ino_from_file(id);
+		file_stat(mfs, file, &e.attr);
+		file_free(file);
+	}
+	e.attr_timeout = mfs->attr_timeout;
+	e.entry_timeout = mfs->entry_timeout;
+	_reply->entry(req, &e);
+}
+
+static void dmxfs_forget(fuse_req_t req, fuse_ino_t ino, uint64_t nlookup)
+{
+	/* files do not hold any state */
+	if (!node_ino_is_file(ino) && !node_ino_is_control(ino))
+		node_forget(ino, nlookup);
+	_reply->none(req);
+}
+
+static void dmxfs_forget_multi(fuse_req_t req, size_t count,
+		struct fuse_forget_data *forgets)
+{
+	size_t i;
+
+	for (i = 0; i < count; i++)
+	{
+		if (!node_ino_is_file(forgets[i].ino) &&
+				!node_ino_is_control(forgets[i].ino))
+			node_forget(forgets[i].ino, forgets[i].nlookup);
+	}
+	_reply->none(req);
+}
+
+static void dmxfs_getattr(fuse_req_t req, fuse_ino_t ino,
+		struct fuse_file_info *fi)
+{
+	struct stat stbuf;
+	dmxfs *mfs;
+
+	mfs = _reply->userdata(req);
+	if (node_ino_is_file(ino))
+	{
+		File *file;
+
+		file = file_get_from_id(dmxfs_db(mfs), node_ino_to_file(ino));
+		if (!file)
+		{
+			_reply->err(req, ENOENT);
+			return;
+		}
+		file_stat(mfs, file, &stbuf);
+		file_free(file);
+	}
+	else if (node_ino_is_control(ino))
+	{
+		if (!control_get(ino))
+		{
+			_reply->err(req, ENOENT);
+			return;
+		}
+		control_stat(ino, &stbuf);
+	}
+	else
+	{
+		Node *node;
+
+		node = node_get(ino);
+		if (!node)
+		{
+			_reply->err(req, ENOENT);
+			return;
+		}
+		node_stat(node, &stbuf);
+	}
+	_reply->attr(req, &stbuf, mfs->attr_timeout);
+}
+
+static void dmxfs_readlink(fuse_req_t req, fuse_ino_t ino)
+{
+	File *file;
+	dmxfs *mfs;
+
+	mfs = _reply->userdata(req);
+	if (!node_ino_is_file(ino) || mfs->regular)
+	{
+		_reply->err(req, EINVAL);
+		return;
+	}
+	file = file_get_from_id(dmxfs_db(mfs), node_ino_to_file(ino));
+	if (!file)
+	{
+		_reply->err(req, ENOENT);
+		return;
+	}
+	_reply->readlink(req, file->name);
+	file_free(file);
+}
+
+/* On the regular mode the files are opened on behalf of the client, the
+ * kernel either reads the real file by itself or we splice it from the
+ * descriptor without copying it to our memory
+ */
+static void dmxfs_open(fuse_req_t req, fuse_ino_t ino,
+		struct fuse_file_info *fi)
+{
+	dmxfs_handle *h;
+	File *file;
+	dmxfs *mfs;
+	int fd;
+
+	mfs = _reply->userdata(req);
+	if (node_ino_is_control(ino))
+	{
+		dmxfs_control *control;
+
+		control = control_get(ino);
+		if (!control)
+		{
+			_reply->err(req, ENOENT);
+			return;
+		}
+		if ((fi->flags & O_ACCMODE) != O_RDONLY)
+		{
+			_reply->err(req, EACCES);
+			return;
+		}
+		h = calloc(1, sizeof(dmxfs_handle));
+		h->fd = -1;
+		h->data = control->read(mfs);
+		h->size = strlen(h->data);
+		/* the size reported is zero, never use the page cache */
+		fi->direct_io = 1;
+		fi->fh = (uintptr_t)h;
+		_reply->open(req, fi);
+		return;
+	}
+	if (!node_ino_is_file(ino))
+	{
+		_reply->err(req, EISDIR);
+		return;
+	}
+	if (!mfs->regular)
+	{
+		_reply->err(req, ELOOP);
+		return;
+	}
+	if ((fi->flags & O_ACCMODE) != O_RDONLY)
+	{
+		_reply->err(req, EACCES);
+		return;
+	}
+	file = file_get_from_id(dmxfs_db(mfs), node_ino_to_file(ino));
+	if (!file)
+	{
+		_reply->err(req, ENOENT);
+		return;
+	}
+	fd = open(file->name, O_RDONLY);
+	file_free(file);
+	if (fd < 0)
+	{
+		_reply->err(req, errno);
+		return;
+	}
+
+	h = calloc(1, sizeof(dmxfs_handle));
+	h->fd = fd;
+#ifdef FUSE_CAP_PASSTHROUGH
+	/* it fails without enough privileges, the reads go through us then */
+	if (mfs->passthrough)
+	{
+		h->backing_id = fuse_passthrough_open(req, fd);
+		if (h->backing_id > 0)
+			fi->backing_id = h->backing_id;
+	}
+#endif
+	/* the page cache is dropped whenever the scanner sees a change */
+	fi->keep_cache = 1;
+	fi->fh = (uintptr_t)h;
+	_reply->open(req, fi);
+}
+
+static void dmxfs_read(fuse_req_t req, fuse_ino_t ino, size_t size,
+		off_t off, struct fuse_file_info *fi)
+{
+	dmxfs_handle *h = (dmxfs_handle *)(uintptr_t)fi->fh;
+	struct fuse_bufvec buf = FUSE_BUFVEC_INIT(size);
+
+	if (h->data)
+	{
+		if ((size_t)off >= h->size)
+			_reply->buf(req, NULL, 0);
+		else
+			_reply->buf(req, h->data + off, MIN(size, h->size - off));
+		return;
+	}
+	buf.buf[0].flags = FUSE_BUF_IS_FD | FUSE_BUF_FD_SEEK;
+	buf.buf[0].fd = h->fd;
+	buf.buf[0].pos = off;
+	_reply->data(req, &buf, FUSE_BUF_SPLICE_MOVE);
+}
+
+static void dmxfs_release(fuse_req_t req, fuse_ino_t ino,
+		struct fuse_file_info *fi)
+{
+	dmxfs_handle *h = (dmxfs_handle *)(uintptr_t)fi->fh;
+
+#ifdef FUSE_CAP_PASSTHROUGH
+	if (h->backing_id > 0)
+		fuse_passthrough_close(req, h->backing_id);
+#endif
+	if (h->data)
+		g_free(h->data);
+	else
+		close(h->fd);
+	free(h);
+	_reply->err(req, 0);
+}
+
+/* The listing of a directory is fetched once on opendir and kept on the
+ * handle, that way every readdir call sees the same entries whatever the
+ * scanner does in the meantime. Files listings too big to be kept are
+ * read page by page instead, up to the last file written when opened
+ */
+static void dmxfs_opendir(fuse_req_t req, fuse_ino_t ino,
+		struct fuse_file_info *fi)
+{
+	dmxfs_dir *dir;
+	dmxfs *mfs;
+	Node *node;
+
+	mfs = _reply->userdata(req);
+	if (node_ino_is_file(ino) || node_ino_is_control(ino))
+	{
+		_reply->err(req, ENOTDIR);
+		return;
+	}
+	node = node_get(ino);
+	if (!node)
+	{
+		_reply->err(req, ENOENT);
+		return;
+	}
+	dir = calloc(1, sizeof(dmxfs_dir));
+	if (node->type == NODE_CAPS)
+	{
+		dir->r = readdir_subcaps(mfs, node);
+	}
+	else if (node->type == NODE_FILES)
+	{
+		dir->r = readdir_files(mfs, node);
+		if (readdir_bucketed(mfs, dir->r))
+		{
+			if (dir->r)
+				cache_result_unref(dir->r);
+			dir->r = readdir_buckets(mfs, node);
+			dir->buckets = 1;
+		}
+	}
+	/* a bucket is always read page by page, it is bounded anyway, the
+	 * control directory is static
+	 */
+	/* after the listing, so it has no file after the last one */
+	dir->last = file_last_get();
+	fi->fh = (uintptr_t)dir;
+	_reply->open(req, fi);
+}
+
+static void dmxfs_releasedir(fuse_req_t req, fuse_ino_t ino,
+		struct fuse_file_info *fi)
+{
+	dmxfs_dir *dir = (dmxfs_dir *)(uintptr_t)fi->fh;
+
+	if (dir->r)
+		cache_result_unref(dir->r);
+	free(dir);
+	_reply->err(req, 0);
+}
+
+/* With readdirplus every entry carries its attributes too, so the kernel
+ * does not need to lookup each entry afterwards. Every entry other than
+ * the dot ones counts as a lookup
+ */
+static int readdir_fits(fuse_req_t req, size_t size, size_t pos,
+		const char *name, int plus)
+{
+	size_t len;
+
+	if (plus)
+		len = _reply->add_direntry_plus(req, NULL, 0, name, NULL, 0);
+	else
+		len = _reply->add_direntry(req, NULL, 0, name, NULL, 0);
+
+	return len <= size - pos;
+}
+
+/* add an entry to the reply buffer, returns 0 once the buffer is full */
+static int readdir_add(fuse_req_t req, char *buf, size_t size, size_t *pos,
+		const char *name, struct fuse_entry_param *e, off_t next,
+		int plus)
+{
+	size_t len;
+
+	if (plus)
+		len = _reply->add_direntry_plus(req, buf + *pos, size - *pos, name, e, next);
+	else
+		len = _reply->add_direntry(req, buf + *pos, size - *pos, name, &e->attr, next);
+	if (len > size - *pos)
+		return 0;
+	*pos += len;
+
+	return 1;
+}
+
+/* The entries of a caps directory are 'files' and the caps found together
+ * with the directory caps, the root also lists the control directory
+ * after them. The offset is just the position of the entry
+ */
+static void readdir_fill_caps(fuse_req_t req, dmxfs *mfs, Node *node,
+		CacheResult *r, char *buf, size_t size, size_t *pos, off_t off,
+		int plus)
+{
+	struct fuse_entry_param e;
+	off_t last;
+	off_t i;
+
+	last = node->parent ? r->count : r->count + 1;
+	memset(&e, 0, sizeof(e));
+	e.attr.st_mode = S_IFDIR;
+	for (i = off - 2; i <= last; i++)
+	{
+		const char *name;
+		NodeType type;
+		Cap *cap = NULL;
+
+		if (i == 0)
+		{
+			/* no caps found, no files either */
+			if (!r->count) continue;
+			name = "files";
+			type = NODE_FILES;
+		}
+		else if (i > r->count)
+		{
+			name = DMXFS_CONTROL_DIR;
+			type = NODE_CONTROL;
+		}
+		else
+		{
+			cap = cap_get_from_id(r->ids[i - 1]);
+			if (!cap) continue;
+			name = cap->name;
+			type = NODE_CAPS;
+		}
+		if (plus)
+		{
+			Node *child;
+
+			if (!readdir_fits(req, size, *pos, name, plus))
+				break;
+			child = node_child_ref(node, type, cap, NULL, name);
+			e.ino = child->ino;
+			node_stat(child, &e.attr);
+			e.attr_timeout = mfs->attr_timeout;
+			e.entry_timeout = mfs->entry_timeout;
+		}
+		else
+		{
+			e.attr.st_ino = node_child_ino(node, name);
+			if (!e.attr.st_ino) e.attr.st_ino = DMXFS_UNKNOWN_INO;
+		}
+		if (!readdir_add(req, buf, size, pos, name, &e, i + 3, plus))
+			break;
+	}
+}
+
+/* the control files, the offset is the position of the entry */
+static void readdir_fill_control(fuse_req_t req, dmxfs *mfs, char *buf,
+		size_t size, size_t *pos, off_t off, int plus)
+{
+	struct fuse_entry_param e;
+	off_t i;
+
+	memset(&e, 0, sizeof(e));
+	for (i = off - 2; i < (off_t)DMXFS_CONTROLS; i++)
+	{
+		const char *name = dmxfs_controls[i].name;
+		fuse_ino_t ino = node_ino_from_control(i);
+
+		/* the control files do not hold any state, the lookup they
+		 * count on readdirplus is ignored on forget
+		 */
+		e.ino = ino;
+		control_stat(ino, &e.attr);
+		e.attr_timeout = mfs->attr_timeout;
+		e.entry_timeout = mfs->entry_timeout;
+		if (!readdir_add(req, buf, size, pos, name, &e, i + 3, plus))
+			break;
+	}
+}
+
+/* the position of the first id of @r after @after */
+static unsigned int readdir_files_first(CacheResult *r, unsigned int after)
+{
+	unsigned int lo = 0;
+	unsigned int hi = r->count;
+
+	while (lo < hi)
+	{
+		unsigned int mid = (lo + hi) / 2;
+
+		if (r->ids[mid] <= after) lo = mid + 1;
+		else hi = mid;
+	}
+
+	return lo;
+}
+
+/* The offset of a file entry is its id plus the two dot entries, that way
+ * the next page starts on the first file with a greater id, whatever
+ * happened with the files before it. Huge listings are never loaded at
+ * once, only the files that fit on the reply are fetched. The attributes
+ * come from the same query, so a readdirplus page is a single scan. The
+ * listings pinned on opendir give the same entries on both paths, the ones
+ * read page by page only leave out the files written after the opendir
+ */
+static void readdir_fill_files(fuse_req_t req, dmxfs *mfs, Node *node,
+		dmxfs_dir *dir, char *buf, size_t size, size_t *pos, off_t off,
+		int plus)
+{
+	struct fuse_entry_param e;
+	CacheResult *r = dir->r;
+	unsigned int after;
+	unsigned int first;
+	unsigned int last;
+	char tmp[16];
+
+	after = off > 2 ? off - 2 : 0;
+	readdir_range(node, &first, &last);
+	if (first && after < first - 1)
+		after = first - 1;
+	/* the files written since the opendir are not listed */
+	if (dir->last < last)
+		last = dir->last;
+	memset(&e, 0, sizeof(e));
+	e.attr.st_mode = file_mode(mfs);
+	if (r && !plus)
+	{
+		unsigned int lo = readdir_files_first(r, after);
+
+		for (; lo < r->count; lo++)
+		{
+			snprintf(tmp, sizeof(tmp), "%08d", r->ids[lo]);
+			e.attr.st_ino = node_ino_from_file(r->ids[lo]);
+			if (!readdir_add(req, buf, size, pos, tmp, &e,
+					(off_t)r->ids[lo] + 2, plus))
+				break;
+		}
+	}
+	else
+	{
+		FileSet *files;
+		int limit;
+		int full = 0;
+		unsigned int lo = 0;
+		unsigned int i;
+
+		/* a plain entry takes at least 32 bytes, a plus one 152 */
+		limit = size / (plus ? 152 : 32) + 1;
+		if (r)
+			lo = readdir_files_first(r, after);
+		do
+		{
+			/* the entries pinned on opendir, only their attributes
+			 * are fetched. The files removed since then are not
+			 * found, so it goes on until the reply is full
+			 */
+			if (r)
+			{
+				unsigned int count = MIN((unsigned int)limit, r->count - lo);
+
+				files = file_get_from_ids(dmxfs_db(mfs), r->ids + lo,
+						count);
+				lo += count;
+			}
+			else
+			{
+				files = file_get_from_caps(dmxfs_db(mfs), node->caps,
+						node->query, after,
+						last == UINT_MAX ? 0 : last + 1, limit);
+			}
+			for (i = 0; i < files->count && !full; i++)
+			{
+				File *file = &files->files[i];
+
+				snprintf(tmp, sizeof(tmp), "%08d", file->id);
+				file_stat(mfs, file, &e.attr);
+				e.ino = e.attr.st_ino;
+				e.attr_timeout = mfs->attr_timeout;
+				e.entry_timeout = mfs->entry_timeout;
+				full = !readdir_add(req, buf, size, pos, tmp, &e,
+						(off_t)file->id + 2, plus);
+			}
+			file_set_free(files);
+		} while (r && !full && lo < r->count);
+	}
+}
+
+/* The buckets are at the offset of its number plus the two dot entries */
+static void readdir_fill_buckets(fuse_req_t req, dmxfs *mfs, Node *node,
+		CacheResult *r, char *buf, size_t size, size_t *pos, off_t off,
+		int plus)
+{
+	struct fuse_entry_param e;
+	char tmp[32];
+	unsigned int lo = 0;
+	unsigned int hi = r->count;
+
+	memset(&e, 0, sizeof(e));
+	e.attr.st_mode = S_IFDIR;
+	/* look for the first bucket after the offset */
+	while (lo < hi)
+	{
+		unsigned int mid = (lo + hi) / 2;
+
+		if ((off_t)r->ids[mid] + 2 < off) lo = mid + 1;
+		else hi = mid;
+	}
+	for (; lo < r->count; lo++)
+	{
+		unsigned int first = r->ids[lo] * mfs->bucket_size;
+
+		snprintf(tmp, sizeof(tmp), DMXFS_BUCKET_FORMAT, first,
+				first + mfs->bucket_size - 1);
+		if (plus)
+		{
+			Node *child;
+
+			if (!readdir_fits(req, size, *pos, tmp, plus))
+				break;
+			child = node_child_ref(node, NODE_BUCKET, NULL, NULL, tmp);
+			e.ino = child->ino;
+			node_stat(child, &e.attr);
+			e.attr_timeout = mfs->attr_timeout;
+			e.entry_timeout = mfs->entry_timeout;
+		}
+		else
+		{
+			e.attr.st_ino = node_child_ino(node, tmp);
+			if (!e.attr.st_ino) e.attr.st_ino = DMXFS_UNKNOWN_INO;
+		}
+		if (!readdir_add(req, buf, size, pos, tmp, &e,
+				(off_t)r->ids[lo] + 3, plus))
+			break;
+	}
+}
+
+static void readdir_common(fuse_req_t req, fuse_ino_t ino, size_t size,
+		off_t off, struct fuse_file_info *fi, int plus)
+{
+	dmxfs_dir *dir = (dmxfs_dir *)(uintptr_t)fi->fh;
+	struct fuse_entry_param e;
+	dmxfs *mfs;
+	Node *node;
+	char *buf;
+	size_t pos = 0;
+
+	mfs = _reply->userdata(req);
+	node = node_get(ino);
+	if (!node)
+	{
+		_reply->err(req, ENOENT);
+		return;
+	}
+
+	DMXFS_DBG(LOG_FUSE, "reading dir %s with offset %lld", node->name, (long long)off);
+	buf = malloc(size);
+	/* add simple '.' and '..' files */
+	memset(&e, 0, sizeof(e));
+	e.attr.st_mode = S_IFDIR;
+	if (off < 1)
+	{
+		e.attr.st_ino = node->ino;
+		if (!readdir_add(req, buf, size, &pos, ".", &e, 1, plus))
+			goto done;
+	}
+	if (off < 2)
+	{
+		e.attr.st_ino = node->parent ? node->parent->ino : node->ino;
+		if (!readdir_add(req, buf, size, &pos, "..", &e, 2, plus))
+			goto done;
+	}
+	if (node->type == NODE_CAPS)
+		readdir_fill_caps(req, mfs, node, dir->r, buf, size, &pos, off < 2 ? 2 : off, plus);
+	else if (node->type == NODE_CONTROL)
+		readdir_fill_control(req, mfs, buf, size, &pos, off < 2 ? 2 : off, plus);
+	else if (dir->buckets)
+		readdir_fill_buckets(req, mfs, node, dir->r, buf, size, &pos, off, plus);
+	else
+		readdir_fill_files(req, mfs, node, dir, buf, size, &pos, off, plus);
+done:
+	_reply->buf(req, buf, pos);
+	free(buf);
+}
+
+static void dmxfs_readdir(fuse_req_t req, fuse_ino_t ino, size_t size,
+		off_t off, struct fuse_file_info *fi)
+{
+	readdir_common(req, ino, size, off, fi, 0);
+}
+
+static void dmxfs_readdirplus(fuse_req_t req, fuse_ino_t ino, size_t size,
+		off_t off, struct fuse_file_info *fi)
+{
+	readdir_common(req, ino, size, off, fi, 1);
+}
+
+/* the stream information is exposed as user.dmxfs.* attributes */
+static const char *dmxfs_xattrs[] = {
+	"user.dmxfs.caps",
+	"user.dmxfs.duration",
+	"user.dmxfs.bitrate",
+	"user.dmxfs.resolution",
+};
+
+/* the caps of the file separated by commas */
+static char * xattr_caps(dmxfs *mfs, File *file)
+{
+	GString *value;
+	GList *caps;
+	GList *l;
+
+	caps = cap_get_from_file(dmxfs_db(mfs), file->id);
+	if (!caps) return NULL;
+
+	value = g_string_new("");
+	for (l = caps; l; l = l->next)
+	{
+		Cap *cap = l->data;
+
+		g_string_append_printf(value, "%s%s", l == caps ? "" : ",",
+				cap->name);
+	}
+	g_list_free(caps);
+
+	return g_string_free(value, FALSE);
+}
+
+/* the returned value must be freed with g_free() */
+static char * xattr_value(dmxfs *mfs, File *file, const char *name)
+{
+	if (!strcmp(name, "user.dmxfs.caps"))
+		return xattr_caps(mfs, file);
+	if (!strcmp(name, "user.dmxfs.duration") && file->duration)
+		return g_strdup_printf("%u", file->duration);
+	if (!strcmp(name, "user.dmxfs.bitrate") && file->bitrate)
+		return g_strdup_printf("%u", file->bitrate);
+	if (!strcmp(name, "user.dmxfs.resolution") && file->width)
+		return g_strdup_printf("%ux%u", file->width, file->height);
+	return NULL;
+}
+
+static void dmxfs_getxattr(fuse_req_t req, fuse_ino_t ino, const char *name,
+		size_t size)
+{
+	dmxfs *mfs;
+	File *file;
+	char *value;
+	size_t len;
+
+	mfs = _reply->userdata(req);
+	if (!node_ino_is_file(ino))
+	{
+		_reply->err(req, ENODATA);
+		return;
+	}
+	file = file_get_from_id(dmxfs_db(mfs), node_ino_to_file(ino));
+	if (!file)
+	{
+		_reply->err(req, ENOENT);
+		return;
+	}
+	value = xattr_value(mfs, file, name);
+	file_free(file);
+	if (!value)
+	{
+		_reply->err(req, ENODATA);
+		return;
+	}
+
+	len = strlen(value);
+	if (!size)
+		_reply->xattr(req, len);
+	else if (size < len)
+		_reply->err(req, ERANGE);
+	else
+		_reply->buf(req, value, len);
+	g_free(value);
+}
+
+static void dmxfs_listxattr(fuse_req_t req, fuse_ino_t ino, size_t size)
+{
+	dmxfs *mfs;
+	File *file;
+	GString *list;
+	unsigned int i;
+
+	mfs = _reply->userdata(req);
+	if (!node_ino_is_file(ino))
+	{
+		if (size) _reply->buf(req, NULL, 0);
+		else _reply->xattr(req, 0);
+		return;
+	}
+	file = file_get_from_id(dmxfs_db(mfs), node_ino_to_file(ino));
+	if (!file)
+	{
+		_reply->err(req, ENOENT);
+		return;
+	}
+	/* the names with their terminating null, one after the other */
+	list = g_string_new("");
+	for (i = 0; i < sizeof(dmxfs_xattrs) / sizeof(char *); i++)
+	{
+		char *value;
+
+		/* only list the attributes we know about */
+		value = xattr_value(mfs, file, dmxfs_xattrs[i]);
+		if (!value)
+			continue;
+		g_free(value);
+		g_string_append_len(list, dmxfs_xattrs[i],
+				strlen(dmxfs_xattrs[i]) + 1);
+	}
+	file_free(file);
+
+	if (!size)
+		_reply->xattr(req, list->len);
+	else if (size < list->len)
+		_reply->err(req, ERANGE);
+	else
+		_reply->buf(req, list->str, list->len);
+	g_string_free(list, TRUE);
+}
+
+static void dmxfs_statfs(fuse_req_t req, fuse_ino_t ino)
+{
+	struct statvfs stbuf;
+	unsigned int files;
+	uint64_t bytes;
+
+	/* the counters are always up to date, nothing to query */
+	file_counters_get(&files, &bytes);
+	memset(&stbuf, 0, sizeof(stbuf));
+	stbuf.f_bsize = 512;
+	stbuf.f_frsize = 512;
+	stbuf.f_blocks = (bytes + 511) / 512;
+	stbuf.f_files = files + cap_count();
+	stbuf.f_namemax = NAME_MAX;
+	_reply->statfs(req, &stbuf);
+}
+
+/**
+ * Here we handle all the logic of the mv operation
+ */
+static void dmxfs_rename(fuse_req_t req, fuse_ino_t parent, const char *name,
+		fuse_ino_t newparent, const char *newname, unsigned int flags)
+{
+	_reply->err(req, EACCES);
+}
+
+static void dmxfs_init(void *userdata, struct fuse_conn_info *conn)
+{
+	dmxfs *mfs = userdata;
+
+	/* setup the connection info */
+	if (conn->capable & FUSE_CAP_ASYNC_READ)
+		conn->want |= FUSE_CAP_ASYNC_READ;
+	if (conn->capable & FUSE_CAP_READDIRPLUS)
+		conn->want |= FUSE_CAP_READDIRPLUS;
+#ifdef FUSE_CAP_CACHE_SYMLINKS
+	/* the links are invalidated as any other attribute */
+	if (conn->capable & FUSE_CAP_CACHE_SYMLINKS)
+		conn->want |= FUSE_CAP_CACHE_SYMLINKS;
+#endif
+	if (mfs->regular)
+	{
+		/* move the pages of the real file instead of copying them, the
+		 * readahead is left at the maximum the kernel offers
+		 */
+		if (conn->capable & FUSE_CAP_SPLICE_READ)
+			conn->want |= FUSE_CAP_SPLICE_READ;
+		if (conn->capable & FUSE_CAP_SPLICE_WRITE)
+			conn->want |= FUSE_CAP_SPLICE_WRITE;
+		if (conn->capable & FUSE_CAP_SPLICE_MOVE)
+			conn->want |= FUSE_CAP_SPLICE_MOVE;
+#ifdef FUSE_CAP_PASSTHROUGH
+		if (conn->capable & FUSE_CAP_PASSTHROUGH)
+		{
+			conn->want |= FUSE_CAP_PASSTHROUGH;
+			mfs->passthrough = 1;
+		}
+#endif
+	}
+	/* a prebuilt index never changes */
+	if (mfs->index || mfs->noscan)
+		return;
+	/* update the database, the gst pipelines are created on demand */
+	dmxfs_scan(mfs);
+	/* monitor file changes */
+#if HAVE_INOTIFY
+	dmxfs_monitor(mfs);
+#endif
+}
+
+/* every request is timed as a whole, the reply included */
+#define DMXFS_TIMED(op, metric, proto, args) \
+static void dmxfs_##op##_timed proto \
+{ \
+	uint64_t start = metrics_now(); \
+	dmxfs_##op args; \
+	metrics_observe(metric, start); \
+}
+
+DMXFS_TIMED(lookup, METRIC_FUSE_LOOKUP,
+		(fuse_req_t req, fuse_ino_t parent, const char *name),
+		(req, parent, name))
+DMXFS_TIMED(getattr, METRIC_FUSE_GETATTR,
+		(fuse_req_t req, fuse_ino_t ino, struct fuse_file_info *fi),
+		(req, ino, fi))
+DMXFS_TIMED(readlink, METRIC_FUSE_READLINK,
+		(fuse_req_t req, fuse_ino_t ino),
+		(req, ino))
+DMXFS_TIMED(open, METRIC_FUSE_OPEN,
+		(fuse_req_t req, fuse_ino_t ino, struct fuse_file_info *fi),
+		(req, ino, fi))
+DMXFS_TIMED(read, METRIC_FUSE_READ,
+		(fuse_req_t req, fuse_ino_t ino, size_t size, off_t off,
+		struct fuse_file_info *fi),
+		(req, ino, size, off, fi))
+DMXFS_TIMED(opendir, METRIC_FUSE_OPENDIR,
+		(fuse_req_t req, fuse_ino_t ino, struct fuse_file_info *fi),
+		(req, ino, fi))
+DMXFS_TIMED(readdir, METRIC_FUSE_READDIR,
+		(fuse_req_t req, fuse_ino_t ino, size_t size, off_t off,
+		struct fuse_file_info *fi),
+		(req, ino, size, off, fi))
+DMXFS_TIMED(readdirplus, METRIC_FUSE_READDIRPLUS,
+		(fuse_req_t req, fuse_ino_t ino, size_t size, off_t off,
+		struct fuse_file_info *fi),
+		(req, ino, size, off, fi))
+DMXFS_TIMED(getxattr, METRIC_FUSE_GETXATTR,
+		(fuse_req_t req, fuse_ino_t ino, const char *name, size_t size),
+		(req, ino, name, size))
+DMXFS_TIMED(listxattr, METRIC_FUSE_LISTXATTR,
+		(fuse_req_t req, fuse_ino_t ino, size_t size),
+		(req, ino, size))
+DMXFS_TIMED(statfs, METRIC_FUSE_STATFS,
+		(fuse_req_t req, fuse_ino_t ino),
+		(req, ino))
+/*============================================================================*
+ *                                 Global                                     *
+ *============================================================================*/
+/* the scanner tells what changed on the index, see scan_invalidate() */
+void dmxfs_invalidate(uint64_t ino, const char *name, void *data)
+{
+	dmxfs *mfs = data;
+
+	if (name)
+		fuse_lowlevel_notify_inval_entry(mfs->se, ino, name, strlen(name));
+	else
+		fuse_lowlevel_notify_inval_inode(mfs->se, ino, 0, 0);
+}
+
+/* the requests the operations get must be the ones @reply expects, NULL
+ * goes back to the libfuse replies
+ */
+void dmxfs_reply_set(const dmxfs_reply *reply)
+{
+	_reply = reply ? reply : &_fuse_reply;
+}
+
+const struct fuse_lowlevel_ops dmxfs_ops = {
+	.init         = dmxfs_init,
+	.lookup       = dmxfs_lookup_timed,
+	.forget       = dmxfs_forget,
+	.forget_multi = dmxfs_forget_multi,
+	.getattr      = dmxfs_getattr_timed,
+	.readlink     = dmxfs_readlink_timed,
+	.open         = dmxfs_open_timed,
+	.read         = dmxfs_read_timed,
+	.release      = dmxfs_release,
+	.opendir      = dmxfs_opendir_timed,
+	.readdir      = dmxfs_readdir_timed,
+	.readdirplus  = dmxfs_readdirplus_timed,
+	.releasedir   = dmxfs_releasedir,
+	.statfs       = dmxfs_statfs_timed,
+	.rename       = dmxfs_rename,
+	.getxattr     = dmxfs_getxattr_timed,
+	.listxattr    = dmxfs_listxattr_timed,
+};
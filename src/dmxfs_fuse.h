@@ -0,0 +1,35 @@
+#ifndef DMXFS_FUSE_H_
+#define DMXFS_FUSE_H_
+
+/* The operations reply through these, see dmxfs_fuse.c. The daemon uses
+ * the ones of libfuse, the benchmarks catch the replies without mounting
+ * anything
+ */
+typedef struct _dmxfs_reply
+{
+	void * (*userdata)(fuse_req_t req);
+	int (*err)(fuse_req_t req, int err);
+	void (*none)(fuse_req_t req);
+	int (*entry)(fuse_req_t req, const struct fuse_entry_param *e);
+	int (*attr)(fuse_req_t req, const struct stat *attr,
+			double attr_timeout);
+	int (*readlink)(fuse_req_t req, const char *link);
+	int (*open)(fuse_req_t req, const struct fuse_file_info *fi);
+	int (*buf)(fuse_req_t req, const char *buf, size_t size);
+	int (*data)(fuse_req_t req, struct fuse_bufvec *bufv,
+			enum fuse_buf_copy_flags flags);
+	int (*statfs)(fuse_req_t req, const struct statvfs *stbuf);
+	int (*xattr)(fuse_req_t req, size_t count);
+	size_t (*add_direntry)(fuse_req_t req, char *buf, size_t bufsize,
+			const char *name, const struct stat *stbuf, off_t off);
+	size_t (*add_direntry_plus)(fuse_req_t req, char *buf, size_t bufsize,
+			const char *name, const struct fuse_entry_param *e,
+			off_t off);
+} dmxfs_reply;
+
+extern const struct fuse_lowlevel_ops dmxfs_ops;
+
+void dmxfs_reply_set(const dmxfs_reply *reply);
+void dmxfs_invalidate(uint64_t ino, const char *name, void *data);
+
+#endif
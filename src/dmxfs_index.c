@@ -0,0 +1,341 @@
+/* Offline builder of the index. The roots are scanned by as many workers
+ * as cores, each one with its own pipelines and database connection, with
+ * the same code dmxfs runs on mount. Once every file is there the indexes
+ * only needed to serve are built, the statistics gathered and the database
+ * compacted, so dmxfs can serve it with -o index without scanning anything
+ */
+#ifdef HAVE_CONFIG_H
+#include "config.h"
+#endif
+
+#include <stdlib.h>
+#include <string.h>
+#include <stdio.h>
+#include <stdint.h>
+#include <limits.h>
+#include <errno.h>
+#include <unistd.h>
+#include <dirent.h>
+#include <getopt.h>
+#include <sys/stat.h>
+#include <pthread.h>
+#include <glib.h>
+#include <sqlite3.h>
+#include "dmxfs.h"
+/*============================================================================*
+ *                                  Local                                     *
+ *============================================================================*/
+/* The directories to scan are shared by every worker, a worker that finds
+ * a subdirectory queues it instead of descending on it. The scan is over
+ * when the queue is empty and no worker is scanning
+ */
+typedef struct _IndexDir
+{
+	char *path;
+	/* the root the directory is found on */
+	dmxfs_root *root;
+} IndexDir;
+
+typedef struct _Index
+{
+	GQueue *dirs;
+	pthread_mutex_t lock;
+	pthread_cond_t cond;
+	unsigned int busy;
+} Index;
+
+typedef struct _IndexWorker
+{
+	Index *index;
+	/* the pipelines of this worker, its root changes with every directory */
+	dmxfs_scanner scanner;
+} IndexWorker;
+
+static void index_dir_push(Index *index, const char *path, dmxfs_root *root)
+{
+	IndexDir *dir;
+
+	dir = malloc(sizeof(IndexDir));
+	dir->path = strdup(path);
+	dir->root = root;
+	pthread_mutex_lock(&index->lock);
+	g_queue_push_tail(index->dirs, dir);
+	pthread_cond_signal(&index->cond);
+	pthread_mutex_unlock(&index->lock);
+}
+
+/* the next directory to scan, NULL once there is nothing else to do */
+static IndexDir * index_dir_pop(Index *index)
+{
+	IndexDir *dir;
+
+	pthread_mutex_lock(&index->lock);
+	while (g_queue_is_empty(index->dirs) && index->busy)
+		pthread_cond_wait(&index->cond, &index->lock);
+	dir = g_queue_pop_head(index->dirs);
+	if (dir)
+		index->busy++;
+	pthread_mutex_unlock(&index->lock);
+
+	return dir;
+}
+
+static void index_dir_done(Index *index)
+{
+	pthread_mutex_lock(&index->lock);
+	index->busy--;
+	/* wake the workers waiting for a directory that will never come */
+	if (!index->busy && g_queue_is_empty(index->dirs))
+		pthread_cond_broadcast(&index->cond);
+	pthread_mutex_unlock(&index->lock);
+}
+
+static void index_dir_scan(IndexWorker *w, IndexDir *dir)
+{
+	dmxfs_scan_stats *stats = &w->scanner.stats;
+	const char *path = dir->path;
+	DIR *dp;
+	struct dirent *de;
+	uint64_t start;
+
+	w->scanner.root = dir->root;
+	start = scan_now();
+	dp = opendir(path);
+	if (!dp)
+	{
+		DMXFS_WARN(LOG_SCAN, "cannot scan dir %s", path);
+		return;
+	}
+	stats->dirs++;
+	while ((de = readdir(dp)) != NULL)
+	{
+		char realfile[PATH_MAX];
+		struct stat st;
+
+		if (!strcmp(de->d_name, ".") || !strcmp(de->d_name, ".."))
+			continue;
+
+		snprintf(realfile, sizeof(realfile), "%s/%s", path, de->d_name);
+		if (stat(realfile, &st) < 0)
+		{
+			DMXFS_WARN(LOG_SCAN, "err on stat %d %s", errno, realfile);
+			continue;
+		}
+		if (S_ISDIR(st.st_mode))
+			index_dir_push(w->index, realfile, dir->root);
+		else if (S_ISREG(st.st_mode))
+			start = scan_file(&w->scanner, realfile, st.st_mtime,
+					st.st_size, start);
+	}
+	closedir(dp);
+	stats->walk += scan_now() - start;
+}
+
+static void * _worker(void *data)
+{
+	IndexWorker *w = data;
+	IndexDir *dir;
+	sqlite3 *db;
+
+	db = dmxfs_db(w->scanner.mfs);
+	if (!db) return NULL;
+	/* a crash leaves an index that is not renamed anyway */
+	sqlite3_exec(db, "PRAGMA synchronous=OFF;", NULL, NULL, NULL);
+	while ((dir = index_dir_pop(w->index)))
+	{
+		index_dir_scan(w, dir);
+		free(dir->path);
+		free(dir);
+		index_dir_done(w->index);
+	}
+	return NULL;
+}
+
+static void index_db_remove(const char *path)
+{
+	char tmp[PATH_MAX];
+
+	unlink(path);
+	snprintf(tmp, sizeof(tmp), "%s-wal", path);
+	unlink(tmp);
+	snprintf(tmp, sizeof(tmp), "%s-shm", path);
+	unlink(tmp);
+}
+
+/* the statements run once every file is on the index */
+static const char *_finish[] = {
+	/* dropped during the load, see main() */
+	"CREATE INDEX IF NOT EXISTS filecaps_cap ON filecaps(cap, file);",
+	"ANALYZE;",
+	/* a single file, nothing else to ship */
+	"PRAGMA journal_mode=DELETE;",
+	"VACUUM;",
+};
+
+static int index_finish(sqlite3 *db)
+{
+	unsigned int i;
+
+	for (i = 0; i < sizeof(_finish) / sizeof(char *); i++)
+	{
+		char *err = NULL;
+
+		if (sqlite3_exec(db, _finish[i], NULL, NULL, &err) != SQLITE_OK)
+		{
+			fprintf(stderr, "could not run %s: %s\n", _finish[i], err);
+			sqlite3_free(err);
+			return 0;
+		}
+	}
+	return 1;
+}
+
+static void index_usage(void)
+{
+	printf("Usage:\n");
+	printf("dmxfs-index [options] INDEX DIR...\n");
+	printf("\n");
+	printf("    -j N          number of workers (one per core)\n");
+	printf("\n");
+}
+/*============================================================================*
+ *                                 Global                                     *
+ *============================================================================*/
+int main(int argc, char **argv)
+{
+	dmxfs_scan_stats stats;
+	IndexWorker *workers;
+	Index index;
+	dmxfs *mfs;
+	char tmp[PATH_MAX];
+	unsigned int files;
+	uint64_t bytes;
+	uint64_t start;
+	long jobs;
+	int opt;
+	int ret = 1;
+	int i;
+
+	jobs = sysconf(_SC_NPROCESSORS_ONLN);
+	while ((opt = getopt(argc, argv, "j:h")) != -1)
+	{
+		switch (opt)
+		{
+			case 'j': jobs = strtol(optarg, NULL, 10); break;
+			default:
+			index_usage();
+			return opt != 'h';
+		}
+	}
+	if (argc - optind < 2 || jobs < 1)
+	{
+		index_usage();
+		return 1;
+	}
+
+	start = scan_now();
+	/* built aside and renamed once complete */
+	snprintf(tmp, sizeof(tmp), "%s.tmp", argv[optind]);
+	index_db_remove(tmp);
+	mfs = calloc(1, sizeof(dmxfs));
+	mfs->dbpath = strdup(tmp);
+	if (!db_setup(mfs))
+	{
+		fprintf(stderr, "could not setup the database %s\n", tmp);
+		free(mfs->dbpath);
+		mfs->dbpath = NULL;
+		goto end;
+	}
+	cache_init(DMXFS_CACHE_SIZE);
+	node_init();
+	/* the files of a cap are only fetched to serve, maintaining the index
+	 * on every insert is slower than building it at the end. The one by
+	 * file is kept, the inserts of the filecaps need it
+	 */
+	sqlite3_exec(dmxfs_db(mfs), "DROP INDEX IF EXISTS filecaps_cap;",
+			NULL, NULL, NULL);
+
+	memset(&index, 0, sizeof(index));
+	index.dirs = g_queue_new();
+	pthread_mutex_init(&index.lock, NULL);
+	pthread_cond_init(&index.cond, NULL);
+	for (i = optind + 1; i < argc; i++)
+	{
+		char path[PATH_MAX];
+		dmxfs_root *root;
+
+		/* the files are stored by their absolute path */
+		if (!realpath(argv[i], path))
+		{
+			fprintf(stderr, "could not find %s: %s\n", argv[i], strerror(errno));
+			continue;
+		}
+		/* every root is served on its own, see db_roots_load() */
+		root = calloc(1, sizeof(dmxfs_root));
+		root->path = strdup(path);
+		root->id = db_root_add(dmxfs_db(mfs), path);
+		if (!root->id)
+		{
+			fprintf(stderr, "could not add the root %s\n", path);
+			root_free(root);
+			continue;
+		}
+		mfs->roots = g_list_append(mfs->roots, root);
+		index_dir_push(&index, path, root);
+	}
+	/* an empty index must not replace the previous one */
+	if (!mfs->roots)
+	{
+		fprintf(stderr, "none of the directories could be indexed\n");
+		g_queue_free(index.dirs);
+		goto end;
+	}
+
+	workers = calloc(jobs, sizeof(IndexWorker));
+	for (i = 0; i < jobs; i++)
+	{
+		IndexWorker *w = &workers[i];
+
+		w->index = &index;
+		w->scanner.mfs = mfs;
+		if (pthread_create(&w->scanner.thread, NULL, _worker, w))
+		{
+			fprintf(stderr, "could not create the worker %d\n", i);
+			w->scanner.thread = 0;
+		}
+	}
+	memset(&stats, 0, sizeof(stats));
+	for (i = 0; i < jobs; i++)
+	{
+		IndexWorker *w = &workers[i];
+
+		if (w->scanner.thread)
+			pthread_join(w->scanner.thread, NULL);
+		scan_pipelines_put(&w->scanner, 1);
+		stats.dirs += w->scanner.stats.dirs;
+		stats.files += w->scanner.stats.files;
+		stats.media += w->scanner.stats.media;
+	}
+	free(workers);
+	g_queue_free(index.dirs);
+
+	/* every worker connection is closed on its thread exit */
+	if (!index_finish(dmxfs_db(mfs)))
+		goto end;
+	file_counters_load(dmxfs_db(mfs));
+	file_counters_get(&files, &bytes);
+	printf("%u media of %u files on %u directories, %u caps, "
+			"%llu bytes, in %.2f secs\n", stats.media, stats.files,
+			stats.dirs, cap_count(), (unsigned long long)bytes,
+			(scan_now() - start) / 1e9);
+	ret = 0;
+end:
+	dmxfs_free(mfs);
+	if (!ret && rename(tmp, argv[optind]) < 0)
+	{
+		fprintf(stderr, "could not rename %s: %s\n", tmp, strerror(errno));
+		ret = 1;
+	}
+
+	return ret;
+}
@@ -0,0 +1,293 @@
+#ifdef HAVE_CONFIG_H
+#include "config.h"
+#endif
+
+#include <stdlib.h>
+#include <string.h>
+#include <stdio.h>
+#include <stdint.h>
+#include <stdarg.h>
+#include <time.h>
+#include <pthread.h>
+#include <glib.h>
+#include <sqlite3.h>
+#include "dmxfs.h"
+/*============================================================================*
+ *                                  Local                                     *
+ *============================================================================*/
+/* The records are formatted by the thread that logs them and written by a
+ * single thread that drains them, so a slow output never stalls a request.
+ * The ring is a bounded queue where every slot has a sequence number that
+ * tells whether it is free for the producer at a given position or ready
+ * for the consumer; a producer claims a position with a compare and swap
+ * and never waits, when the ring is full the record is dropped
+ */
+#define LOG_RING_SIZE 4096
+#define LOG_MESSAGE_SIZE 256
+/* time the drain thread sleeps when there is nothing to write, in ms */
+#define LOG_DRAIN_INTERVAL 10
+
+typedef struct _LogRecord
+{
+	unsigned long seq;
+	LogCategory category;
+	LogLevel level;
+	struct timespec time;
+	char message[LOG_MESSAGE_SIZE];
+} LogRecord;
+
+static LogRecord _ring[LOG_RING_SIZE];
+static unsigned long _head = 0;
+static unsigned long _tail = 0;
+static unsigned long _dropped = 0;
+static pthread_t _drain;
+static int _running = 0;
+
+static const char *_categories[LOG_CATEGORIES] = {
+	"fuse",
+	"db",
+	"scan",
+	"gst",
+};
+
+static const char *_levels[] = {
+	"error",
+	"warning",
+	"info",
+	"debug",
+};
+
+static void log_record_write(FILE *out, LogRecord *r)
+{
+	struct tm tm;
+
+	localtime_r(&r->time.tv_sec, &tm);
+	fprintf(out, "%02d:%02d:%02d.%06ld %s %s: %s\n", tm.tm_hour, tm.tm_min,
+			tm.tm_sec, r->time.tv_nsec / 1000, _levels[r->level],
+			_categories[r->category], r->message);
+}
+
+static void log_record_format(LogRecord *r, LogCategory category,
+		LogLevel level, const char *fmt, va_list args)
+{
+	size_t len;
+
+	r->category = category;
+	r->level = level;
+	clock_gettime(CLOCK_REALTIME, &r->time);
+	vsnprintf(r->message, LOG_MESSAGE_SIZE, fmt, args);
+	/* every record is a line on its own */
+	len = strlen(r->message);
+	if (len && r->message[len - 1] == '\n')
+		r->message[len - 1] = '\0';
+}
+
+/* write every ready record, only called from the drain thread */
+static int log_drain(FILE *out)
+{
+	unsigned long dropped;
+	int written = 0;
+
+	for (;;)
+	{
+		LogRecord *r = &_ring[_tail % LOG_RING_SIZE];
+
+		if (__atomic_load_n(&r->seq, __ATOMIC_ACQUIRE) != _tail + 1)
+			break;
+		log_record_write(out, r);
+		__atomic_store_n(&r->seq, _tail + LOG_RING_SIZE, __ATOMIC_RELEASE);
+		_tail++;
+		written++;
+	}
+	dropped = __atomic_exchange_n(&_dropped, 0, __ATOMIC_RELAXED);
+	if (dropped)
+		fprintf(out, "%lu log records dropped\n", dropped);
+	if (written || dropped)
+		fflush(out);
+
+	return written;
+}
+
+static void * _drain_cb(void *data)
+{
+	for (;;)
+	{
+		struct timespec ts = { 0, LOG_DRAIN_INTERVAL * 1000000L };
+		int running;
+
+		running = __atomic_load_n(&_running, __ATOMIC_ACQUIRE);
+		if (log_drain(stderr))
+			continue;
+		if (!running)
+			break;
+		nanosleep(&ts, NULL);
+	}
+	return NULL;
+}
+
+static int log_level_parse(const char *str, size_t len, LogLevel *level)
+{
+	int i;
+
+	for (i = 0; i <= LOG_LEVEL_DEBUG; i++)
+	{
+		if (strlen(_levels[i]) == len && !strncmp(str, _levels[i], len))
+		{
+			*level = i;
+			return 1;
+		}
+	}
+	return 0;
+}
+
+static int log_category_parse(const char *str, size_t len, LogCategory *cat)
+{
+	int i;
+
+	for (i = 0; i < LOG_CATEGORIES; i++)
+	{
+		if (strlen(_categories[i]) == len && !strncmp(str, _categories[i], len))
+		{
+			*cat = i;
+			return 1;
+		}
+	}
+	return 0;
+}
+/*============================================================================*
+ *                                 Global                                     *
+ *============================================================================*/
+LogLevel log_levels[LOG_CATEGORIES] = {
+	LOG_LEVEL_WARNING,
+	LOG_LEVEL_WARNING,
+	LOG_LEVEL_WARNING,
+	LOG_LEVEL_WARNING,
+};
+
+/**
+ * Queue a record, use the DMXFS_* macros instead so the disabled levels
+ * do not even format it. Before log_init() the record is written directly
+ */
+void log_print(LogCategory category, LogLevel level, const char *fmt, ...)
+{
+	LogRecord *r;
+	unsigned long pos;
+	va_list args;
+
+	if (!__atomic_load_n(&_running, __ATOMIC_ACQUIRE))
+	{
+		LogRecord tmp;
+
+		va_start(args, fmt);
+		log_record_format(&tmp, category, level, fmt, args);
+		va_end(args);
+		log_record_write(stderr, &tmp);
+		return;
+	}
+
+	pos = __atomic_load_n(&_head, __ATOMIC_RELAXED);
+	for (;;)
+	{
+		long dif;
+
+		r = &_ring[pos % LOG_RING_SIZE];
+		dif = (long)(__atomic_load_n(&r->seq, __ATOMIC_ACQUIRE) - pos);
+		if (!dif)
+		{
+			if (__atomic_compare_exchange_n(&_head, &pos, pos + 1, 0,
+					__ATOMIC_RELAXED, __ATOMIC_RELAXED))
+				break;
+		}
+		else if (dif < 0)
+		{
+			/* full, the drain thread is behind */
+			__atomic_fetch_add(&_dropped, 1, __ATOMIC_RELAXED);
+			return;
+		}
+		else
+		{
+			pos = __atomic_load_n(&_head, __ATOMIC_RELAXED);
+		}
+	}
+	va_start(args, fmt);
+	log_record_format(r, category, level, fmt, args);
+	va_end(args);
+	__atomic_store_n(&r->seq, pos + 1, __ATOMIC_RELEASE);
+}
+
+/**
+ * Set the levels from @spec, either a level for every category like
+ * "debug" or a list of category:level like "scan:debug,db:info"
+ */
+int log_config(const char *spec)
+{
+	const char *str = spec;
+
+	for (;;)
+	{
+		const char *sep;
+		const char *colon;
+		LogCategory cat;
+		LogLevel level;
+
+		sep = strchr(str, ',');
+		if (!sep) sep = str + strlen(str);
+		colon = memchr(str, ':', sep - str);
+		if (colon)
+		{
+			if (!log_category_parse(str, colon - str, &cat) ||
+					!log_level_parse(colon + 1, sep - colon - 1, &level))
+				return 0;
+			log_levels[cat] = level;
+		}
+		else
+		{
+			int i;
+
+			if (!log_level_parse(str, sep - str, &level))
+				return 0;
+			for (i = 0; i < LOG_CATEGORIES; i++)
+				log_levels[i] = level;
+		}
+		if (!*sep) break;
+		str = sep + 1;
+	}
+
+	return 1;
+}
+
+const char * log_category_name(LogCategory category)
+{
+	return _categories[category];
+}
+
+int log_init(void)
+{
+	unsigned long i;
+
+	for (i = 0; i < LOG_RING_SIZE; i++)
+		_ring[i].seq = i;
+	_head = _tail = 0;
+	_running = 1;
+	if (pthread_create(&_drain, NULL, _drain_cb, NULL))
+	{
+		_running = 0;
+		return 0;
+	}
+
+	return 1;
+}
+
+/**
+ * Write whatever is still queued and stop the drain thread, the records
+ * logged afterwards are written directly
+ */
+void log_shutdown(void)
+{
+	if (!__atomic_load_n(&_running, __ATOMIC_ACQUIRE))
+		return;
+	__atomic_store_n(&_running, 0, __ATOMIC_RELEASE);
+	pthread_join(_drain, NULL);
+	/* the ones queued while the drain was finishing */
+	log_drain(stderr);
+}
@@ -0,0 +1,309 @@
+#ifdef HAVE_CONFIG_H
+#include "config.h"
+#endif
+
+#include <stdlib.h>
+#include <string.h>
+#include <stdio.h>
+#include <stdint.h>
+#include <time.h>
+#include <pthread.h>
+#include <glib.h>
+#include <sqlite3.h>
+#include "dmxfs.h"
+/*============================================================================*
+ *                                  Local                                     *
+ *============================================================================*/
+/* The latencies are kept in nanoseconds on log-linear histograms: every
+ * power of two is split on 1 << METRICS_SUB_BITS buckets, so a value is
+ * known with a relative error below 12.5% whatever its magnitude. The
+ * values of 2^METRICS_MAX_BITS ns (about 18 minutes) or more are kept on
+ * the last bucket
+ */
+#define METRICS_SUB_BITS 3
+#define METRICS_SUB_BUCKETS (1 << METRICS_SUB_BITS)
+#define METRICS_MAX_BITS 40
+#define METRICS_BUCKETS ((METRICS_MAX_BITS - METRICS_SUB_BITS + 1) * METRICS_SUB_BUCKETS)
+/* the buckets exported, every power of two from 1us (2^10 ns) on */
+#define METRICS_EXPORT_MIN_BITS 10
+#define METRICS_EXPORT_MAX_BITS 34
+
+/* Every thread has its own histograms, only written by it, so recording
+ * a value is just a couple of plain increments. The threads that exit
+ * leave their histograms to the next thread, the values are cumulative
+ * anyway
+ */
+typedef struct _MetricsThread
+{
+	struct _MetricsThread *next;
+	struct _MetricsThread *next_free;
+	uint64_t buckets[METRICS][METRICS_BUCKETS];
+	uint64_t count[METRICS];
+	uint64_t sum[METRICS];
+} MetricsThread;
+
+typedef struct _MetricsFamily
+{
+	const char *name;
+	const char *help;
+	const char *label;
+	/* the category of the spans, when tracing */
+	LogCategory category;
+} MetricsFamily;
+
+typedef enum _MetricsFamilyId
+{
+	METRICS_FAMILY_FUSE,
+	METRICS_FAMILY_DB,
+	METRICS_FAMILY_SCAN,
+} MetricsFamilyId;
+
+static MetricsFamily _families[] = {
+	{ "dmxfs_fuse_request_duration_seconds",
+			"Time to answer a FUSE request", "op", LOG_FUSE },
+	{ "dmxfs_db_query_duration_seconds",
+			"Time spent on a database helper", "query", LOG_DB },
+	{ "dmxfs_scan_stage_duration_seconds",
+			"Time spent on a scanner stage for a single file", "stage",
+			LOG_SCAN },
+};
+
+typedef struct _MetricsInfo
+{
+	MetricsFamilyId family;
+	const char *label;
+} MetricsInfo;
+
+/* on the same order as Metric */
+static MetricsInfo _metrics[METRICS] = {
+	{ METRICS_FAMILY_FUSE, "lookup" },
+	{ METRICS_FAMILY_FUSE, "getattr" },
+	{ METRICS_FAMILY_FUSE, "readlink" },
+	{ METRICS_FAMILY_FUSE, "open" },
+	{ METRICS_FAMILY_FUSE, "read" },
+	{ METRICS_FAMILY_FUSE, "opendir" },
+	{ METRICS_FAMILY_FUSE, "readdir" },
+	{ METRICS_FAMILY_FUSE, "readdirplus" },
+	{ METRICS_FAMILY_FUSE, "getxattr" },
+	{ METRICS_FAMILY_FUSE, "listxattr" },
+	{ METRICS_FAMILY_FUSE, "statfs" },
+	{ METRICS_FAMILY_DB, "file_get_from_id" },
+	{ METRICS_FAMILY_DB, "file_get_from_name" },
+	{ METRICS_FAMILY_DB, "file_get_from_ids" },
+	{ METRICS_FAMILY_DB, "file_get_from_caps" },
+	{ METRICS_FAMILY_DB, "file_get_ids_from_caps" },
+	{ METRICS_FAMILY_DB, "file_set_media_info" },
+	{ METRICS_FAMILY_DB, "file_counters_load" },
+	{ METRICS_FAMILY_DB, "cap_new_from_name" },
+	{ METRICS_FAMILY_DB, "cap_get_different_from_caps" },
+	{ METRICS_FAMILY_DB, "cap_get_from_file" },
+	{ METRICS_FAMILY_DB, "cap_counters_load" },
+	{ METRICS_FAMILY_DB, "cap_destroy" },
+	{ METRICS_FAMILY_DB, "db_insert_file" },
+	{ METRICS_FAMILY_DB, "db_insert_filecap" },
+	{ METRICS_FAMILY_DB, "db_delete_filecaps" },
+	{ METRICS_FAMILY_DB, "db_file_changed" },
+	{ METRICS_FAMILY_SCAN, "check" },
+	{ METRICS_FAMILY_SCAN, "probe" },
+	{ METRICS_FAMILY_SCAN, "caps" },
+};
+
+static MetricsThread *_threads = NULL;
+static MetricsThread *_free = NULL;
+static pthread_mutex_t _lock = PTHREAD_MUTEX_INITIALIZER;
+static pthread_key_t _key;
+static pthread_once_t _once = PTHREAD_ONCE_INIT;
+static __thread MetricsThread *_thread = NULL;
+
+static void _thread_exit(void *data)
+{
+	MetricsThread *t = data;
+
+	pthread_mutex_lock(&_lock);
+	t->next_free = _free;
+	_free = t;
+	pthread_mutex_unlock(&_lock);
+}
+
+static void _key_create(void)
+{
+	pthread_key_create(&_key, _thread_exit);
+}
+
+static MetricsThread * metrics_thread(void)
+{
+	MetricsThread *t;
+
+	if (_thread) return _thread;
+
+	pthread_once(&_once, _key_create);
+	pthread_mutex_lock(&_lock);
+	t = _free;
+	if (t)
+	{
+		_free = t->next_free;
+	}
+	else
+	{
+		t = calloc(1, sizeof(MetricsThread));
+		t->next = _threads;
+		_threads = t;
+	}
+	pthread_mutex_unlock(&_lock);
+	pthread_setspecific(_key, t);
+	_thread = t;
+
+	return t;
+}
+
+static unsigned int metrics_bucket(uint64_t v)
+{
+	unsigned int bits;
+	unsigned int idx;
+
+	if (v < METRICS_SUB_BUCKETS * 2)
+		return v;
+	bits = 63 - __builtin_clzll(v);
+	idx = ((bits - METRICS_SUB_BITS + 1) << METRICS_SUB_BITS) +
+			((v >> (bits - METRICS_SUB_BITS)) & (METRICS_SUB_BUCKETS - 1));
+
+	return idx < METRICS_BUCKETS ? idx : METRICS_BUCKETS - 1;
+}
+
+/* the reader might see a value being updated, it is never torn though */
+static inline void metrics_add(uint64_t *v, uint64_t n)
+{
+	__atomic_store_n(v, __atomic_load_n(v, __ATOMIC_RELAXED) + n,
+			__ATOMIC_RELAXED);
+}
+
+static inline uint64_t metrics_get(uint64_t *v)
+{
+	return __atomic_load_n(v, __ATOMIC_RELAXED);
+}
+/*============================================================================*
+ *                                 Global                                     *
+ *============================================================================*/
+uint64_t metrics_now(void)
+{
+	struct timespec ts;
+
+	clock_gettime(CLOCK_MONOTONIC, &ts);
+	return (uint64_t)ts.tv_sec * 1000000000ULL + ts.tv_nsec;
+}
+
+/**
+ * Record the time from @start to @end, as returned by metrics_now(), on the
+ * histogram of @m. When tracing it is a span of the timeline too
+ */
+void metrics_span(Metric m, uint64_t start, uint64_t end)
+{
+	MetricsThread *t;
+	uint64_t ns = end - start;
+
+	t = metrics_thread();
+	metrics_add(&t->buckets[m][metrics_bucket(ns)], 1);
+	metrics_add(&t->count[m], 1);
+	metrics_add(&t->sum[m], ns);
+	if (trace_enabled)
+		trace_span(_families[_metrics[m].family].category,
+				_metrics[m].label, start, end);
+}
+
+/**
+ * Record the time elapsed since @start, as returned by metrics_now()
+ */
+void metrics_observe(Metric m, uint64_t start)
+{
+	metrics_span(m, start, metrics_now());
+}
+
+/**
+ * Append every histogram, merged from all the threads, on the Prometheus
+ * text format
+ */
+void metrics_print(GString *s)
+{
+	uint64_t *buckets;
+	uint64_t count[METRICS];
+	uint64_t sum[METRICS];
+	MetricsFamilyId family = -1;
+	MetricsThread *t;
+	int m;
+
+	buckets = calloc(METRICS * METRICS_BUCKETS, sizeof(uint64_t));
+	memset(count, 0, sizeof(count));
+	memset(sum, 0, sizeof(sum));
+	pthread_mutex_lock(&_lock);
+	for (t = _threads; t; t = t->next)
+	{
+		for (m = 0; m < METRICS; m++)
+		{
+			int i;
+
+			for (i = 0; i < METRICS_BUCKETS; i++)
+				buckets[m * METRICS_BUCKETS + i] += metrics_get(&t->buckets[m][i]);
+			count[m] += metrics_get(&t->count[m]);
+			sum[m] += metrics_get(&t->sum[m]);
+		}
+	}
+	pthread_mutex_unlock(&_lock);
+
+	for (m = 0; m < METRICS; m++)
+	{
+		MetricsInfo *info = &_metrics[m];
+		MetricsFamily *f = &_families[info->family];
+		uint64_t cumulative = 0;
+		unsigned int bucket = 0;
+		int bits;
+
+		if (info->family != family)
+		{
+			g_string_append_printf(s, "# HELP %s %s\n", f->name, f->help);
+			g_string_append_printf(s, "# TYPE %s histogram\n", f->name);
+			family = info->family;
+		}
+		/* the power of two bounds fall on the bucket boundaries */
+		for (bits = METRICS_EXPORT_MIN_BITS; bits <= METRICS_EXPORT_MAX_BITS; bits++)
+		{
+			unsigned int last = metrics_bucket((uint64_t)1 << bits);
+
+			for (; bucket < last; bucket++)
+				cumulative += buckets[m * METRICS_BUCKETS + bucket];
+			g_string_append_printf(s, "%s_bucket{%s=\"%s\",le=\"%.9g\"} %llu\n",
+					f->name, f->label, info->label,
+					((uint64_t)1 << bits) / 1e9,
+					(unsigned long long)cumulative);
+		}
+		g_string_append_printf(s, "%s_bucket{%s=\"%s\",le=\"+Inf\"} %llu\n",
+				f->name, f->label, info->label,
+				(unsigned long long)count[m]);
+		g_string_append_printf(s, "%s_sum{%s=\"%s\"} %.9f\n", f->name,
+				f->label, info->label, sum[m] / 1e9);
+		g_string_append_printf(s, "%s_count{%s=\"%s\"} %llu\n", f->name,
+				f->label, info->label, (unsigned long long)count[m]);
+	}
+	free(buckets);
+}
+
+/**
+ * Free every histogram, only once the rest of threads are gone
+ */
+void metrics_shutdown(void)
+{
+	MetricsThread *t;
+
+	_thread = NULL;
+	pthread_mutex_lock(&_lock);
+	t = _threads;
+	_threads = NULL;
+	_free = NULL;
+	pthread_mutex_unlock(&_lock);
+	while (t)
+	{
+		MetricsThread *next = t->next;
+
+		free(t);
+		t = next;
+	}
+}
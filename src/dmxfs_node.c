@@ -0,0 +1,309 @@
+#ifdef HAVE_CONFIG_H
+#include "config.h"
+#endif
+
+#include <stdlib.h>
+#include <string.h>
+#include <stdio.h>
+#include <stdint.h>
+#include <limits.h>
+#include <pthread.h>
+#include <glib.h>
+#include <sqlite3.h>
+#include "dmxfs.h"
+/*============================================================================*
+ *                                  Local                                     *
+ *============================================================================*/
+/* Every directory the kernel knows about is a node on a tree that mirrors
+ * the mount. A node is reachable through its inode number as long as the
+ * kernel holds a lookup reference on it or on any of its children.
+ * Files are not nodes, their inode number is just the file id with the
+ * NODE_INO_FILE bit set
+ */
+static GHashTable *_nodes = NULL;
+static Node *_root = NULL;
+static uint64_t _next_ino = NODE_INO_ROOT;
+static pthread_mutex_t _lock = PTHREAD_MUTEX_INITIALIZER;
+
+static Node * node_new(Node *parent, NodeType type, Cap *cap, Query *query,
+		const char *name)
+{
+	Node *node;
+
+	node = calloc(1, sizeof(Node));
+	node->ino = _next_ino++;
+	node->type = type;
+	node->parent = parent;
+	node->cap = cap;
+	node->name = strdup(name);
+	node->children = g_hash_table_new(g_str_hash, g_str_equal);
+	/* the set of caps is the one of the parent plus our own cap */
+	if (parent)
+	{
+		GList *l;
+
+		for (l = parent->caps; l; l = l->next)
+			node->caps = g_list_append(node->caps, l->data);
+		g_hash_table_insert(parent->children, node->name, node);
+	}
+	if (cap)
+		node->caps = g_list_append(node->caps, cap);
+	/* a query already includes the terms of the parent */
+	if (query)
+		node->query = query;
+	else if (parent && parent->query)
+		node->query = query_ref(parent->query);
+	g_hash_table_insert(_nodes, &node->ino, node);
+
+	return node;
+}
+
+static void node_free(Node *node)
+{
+	g_hash_table_destroy(node->children);
+	if (node->caps)
+		g_list_free(node->caps);
+	if (node->query)
+		query_unref(node->query);
+	free(node->name);
+	free(node);
+}
+
+/* must be called with the lock held */
+static void node_release(Node *node)
+{
+	while (node && node != _root && !node->nlookup &&
+			!g_hash_table_size(node->children))
+	{
+		Node *parent = node->parent;
+
+		g_hash_table_remove(parent->children, node->name);
+		g_hash_table_remove(_nodes, &node->ino);
+		node_free(node);
+		node = parent;
+	}
+}
+
+typedef struct _NodeInvalidation
+{
+	uint64_t ino;
+	char *name;
+} NodeInvalidation;
+
+typedef struct _NodeInvalidateData
+{
+	GList *caps;
+	unsigned int file_id;
+	GList *invalidations;
+} NodeInvalidateData;
+
+static int node_caps_has(GList *caps, Cap *cap)
+{
+	GList *l;
+
+	for (l = caps; l; l = l->next)
+		if (l->data == cap) return 1;
+	return 0;
+}
+
+static void node_invalidation_add(NodeInvalidateData *data, uint64_t ino,
+		char *name)
+{
+	NodeInvalidation *inv;
+
+	inv = malloc(sizeof(NodeInvalidation));
+	inv->ino = ino;
+	inv->name = name;
+	data->invalidations = g_list_prepend(data->invalidations, inv);
+}
+
+static void _node_invalidate_cb(gpointer key, gpointer value, gpointer user_data)
+{
+	NodeInvalidateData *data = user_data;
+	Node *node = value;
+	GList *l;
+
+	/* the control directory never lists files */
+	if (node->type == NODE_CONTROL) return;
+	/* only the directories whose caps are all on the file can list it */
+	for (l = node->caps; l; l = l->next)
+		if (!node_caps_has(data->caps, l->data)) return;
+	if (node->query && !query_match(node->query, data->caps)) return;
+
+	if (node->type == NODE_BUCKET)
+	{
+		unsigned int first;
+		unsigned int last;
+
+		if (!node_bucket_range(node->name, &first, &last) ||
+				data->file_id < first || data->file_id > last)
+			return;
+	}
+	node_invalidation_add(data, node->ino, NULL);
+	if (node->type != NODE_CAPS)
+	{
+		node_invalidation_add(data, node->ino,
+				g_strdup_printf("%08d", data->file_id));
+		return;
+	}
+	/* the caps of the file might be new entries of this directory */
+	for (l = data->caps; l; l = l->next)
+	{
+		Cap *cap = l->data;
+
+		if (node_caps_has(node->caps, cap)) continue;
+		node_invalidation_add(data, node->ino, g_strdup(cap->name));
+	}
+}
+/*============================================================================*
+ *                                 Global                                     *
+ *============================================================================*/
+Node * node_get(uint64_t ino)
+{
+	Node *node;
+
+	pthread_mutex_lock(&_lock);
+	node = g_hash_table_lookup(_nodes, &ino);
+	pthread_mutex_unlock(&_lock);
+
+	return node;
+}
+
+/**
+ * Get the child @name of @parent creating it if needed. The child gets
+ * a new lookup reference. The reference to @query is given to the child,
+ * or released if the child already exists
+ */
+Node * node_child_ref(Node *parent, NodeType type, Cap *cap, Query *query,
+		const char *name)
+{
+	Node *node;
+
+	pthread_mutex_lock(&_lock);
+	node = g_hash_table_lookup(parent->children, name);
+	if (!node)
+		node = node_new(parent, type, cap, query, name);
+	else if (query)
+		query_unref(query);
+	node->nlookup++;
+	pthread_mutex_unlock(&_lock);
+
+	return node;
+}
+
+/**
+ * Get the inode number of the child @name of @parent without creating it,
+ * zero if the kernel does not know about it yet
+ */
+uint64_t node_child_ino(Node *parent, const char *name)
+{
+	Node *node;
+	uint64_t ino = 0;
+
+	pthread_mutex_lock(&_lock);
+	node = g_hash_table_lookup(parent->children, name);
+	if (node) ino = node->ino;
+	pthread_mutex_unlock(&_lock);
+
+	return ino;
+}
+
+void node_forget(uint64_t ino, uint64_t nlookup)
+{
+	Node *node;
+
+	pthread_mutex_lock(&_lock);
+	node = g_hash_table_lookup(_nodes, &ino);
+	if (node)
+	{
+		if (node->nlookup < nlookup) node->nlookup = 0;
+		else node->nlookup -= nlookup;
+		node_release(node);
+	}
+	pthread_mutex_unlock(&_lock);
+}
+
+/**
+ * Parse the name of a bucket, the first and last ids of its range
+ * separated by a dash
+ */
+int node_bucket_range(const char *name, unsigned int *first,
+		unsigned int *last)
+{
+	char *end;
+	unsigned long f;
+	unsigned long l;
+
+	f = strtoul(name, &end, 10);
+	if (end != name + 8 || *end != '-')
+		return 0;
+	l = strtoul(end + 1, &end, 10);
+	if (end != name + 17 || *end || l < f || l > UINT_MAX)
+		return 0;
+	*first = f;
+	*last = l;
+
+	return 1;
+}
+
+/**
+ * Call @cb for every directory and entry the kernel might have cached that
+ * changes when the file @file_id with @caps is added, removed or changed.
+ * @name is NULL when the directory itself must be invalidated. The
+ * callback is called without any lock held
+ */
+void node_invalidate(GList *caps, unsigned int file_id, NodeInvalidateCb cb,
+		void *user_data)
+{
+	NodeInvalidateData data;
+	GList *l;
+
+	data.caps = caps;
+	data.file_id = file_id;
+	data.invalidations = NULL;
+
+	pthread_mutex_lock(&_lock);
+	if (_nodes)
+		g_hash_table_foreach(_nodes, _node_invalidate_cb, &data);
+	pthread_mutex_unlock(&_lock);
+
+	for (l = data.invalidations; l; l = l->next)
+	{
+		NodeInvalidation *inv = l->data;
+
+		cb(inv->ino, inv->name, user_data);
+		g_free(inv->name);
+		free(inv);
+	}
+	if (data.invalidations)
+		g_list_free(data.invalidations);
+}
+
+int node_init(void)
+{
+	_nodes = g_hash_table_new(g_int64_hash, g_int64_equal);
+	_root = node_new(NULL, NODE_CAPS, NULL, NULL, "");
+	/* the root is never forgotten */
+	_root->nlookup = 1;
+
+	return 1;
+}
+
+static gboolean _node_free_cb(gpointer key, gpointer value, gpointer data)
+{
+	node_free(value);
+	return TRUE;
+}
+
+void node_shutdown(void)
+{
+	pthread_mutex_lock(&_lock);
+	if (_nodes)
+	{
+		g_hash_table_foreach_remove(_nodes, _node_free_cb, NULL);
+		g_hash_table_destroy(_nodes);
+		_nodes = NULL;
+		_root = NULL;
+	}
+	pthread_mutex_unlock(&_lock);
+}
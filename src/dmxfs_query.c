@@ -0,0 +1,290 @@
+#ifdef HAVE_CONFIG_H
+#include "config.h"
+#endif
+
+#include <stdlib.h>
+#include <string.h>
+#include <stdio.h>
+#include <stdint.h>
+#include <pthread.h>
+#include <glib.h>
+#include <sqlite3.h>
+#include "dmxfs.h"
+/*============================================================================*
+ *                                  Local                                     *
+ *============================================================================*/
+/* A query is the conjunction of its terms, a term matches the files that
+ * have any of its caps, or none of them when negated. The expression
+ * "+a|b,-c" is parsed into the terms (a OR b) AND NOT (c). The caps of
+ * every term are kept sorted by id so equivalent expressions share the
+ * same key
+ */
+static gint query_cap_cmp(gconstpointer a, gconstpointer b)
+{
+	const Cap *ca = a;
+	const Cap *cb = b;
+
+	return ca->id < cb->id ? -1 : ca->id > cb->id;
+}
+
+static QueryTerm * query_term_new(int negate)
+{
+	QueryTerm *term;
+
+	term = calloc(1, sizeof(QueryTerm));
+	term->negate = negate;
+
+	return term;
+}
+
+static void query_term_free(QueryTerm *term)
+{
+	if (term->caps)
+		g_list_free(term->caps);
+	free(term);
+}
+
+static QueryTerm * query_term_copy(QueryTerm *term)
+{
+	QueryTerm *copy;
+
+	copy = query_term_new(term->negate);
+	copy->caps = g_list_copy(term->caps);
+
+	return copy;
+}
+
+/* parse a single term, the optional sign followed by the caps separated
+ * by '|'
+ */
+static QueryTerm * query_term_parse(const char *str, size_t len)
+{
+	QueryTerm *term;
+	const char *end = str + len;
+	int negate = 0;
+
+	if (len && (*str == '+' || *str == '-'))
+	{
+		negate = *str == '-';
+		str++;
+	}
+	term = query_term_new(negate);
+	while (str <= end)
+	{
+		const char *sep;
+		char *name;
+		Cap *cap;
+
+		sep = memchr(str, '|', end - str);
+		if (!sep) sep = end;
+		name = g_strndup(str, sep - str);
+		cap = cap_get_from_name(name);
+		g_free(name);
+		if (!cap)
+		{
+			query_term_free(term);
+			return NULL;
+		}
+		if (!g_list_find(term->caps, cap))
+			term->caps = g_list_insert_sorted(term->caps, cap,
+					query_cap_cmp);
+		str = sep + 1;
+	}
+
+	return term;
+}
+
+static void query_term_ids(GString *s, QueryTerm *term)
+{
+	GList *l;
+
+	for (l = term->caps; l; l = l->next)
+	{
+		Cap *cap = l->data;
+
+		g_string_append_printf(s, "%s%u", l == term->caps ? "" : ",",
+				cap->id);
+	}
+}
+
+static gint query_key_cmp(gconstpointer a, gconstpointer b)
+{
+	return strcmp(a, b);
+}
+/*============================================================================*
+ *                                 Global                                     *
+ *============================================================================*/
+/**
+ * Check whether a path component is a query expression instead of a cap
+ * name. No cap name starts with a sign nor has commas or pipes
+ */
+int query_is_expression(const char *name)
+{
+	return *name == '+' || *name == '-' || strchr(name, ',') ||
+			strchr(name, '|');
+}
+
+/**
+ * Parse the expression @expr and add its terms to the ones of @parent.
+ * Returns NULL when the expression is invalid or names an unknown cap
+ */
+Query * query_parse(const char *expr, Query *parent)
+{
+	Query *q;
+	const char *str = expr;
+
+	q = calloc(1, sizeof(Query));
+	q->ref = 1;
+	if (parent)
+	{
+		GList *l;
+
+		for (l = parent->terms; l; l = l->next)
+			q->terms = g_list_append(q->terms,
+					query_term_copy(l->data));
+	}
+	for (;;)
+	{
+		QueryTerm *term;
+		const char *sep;
+
+		sep = strchr(str, ',');
+		if (!sep) sep = str + strlen(str);
+		term = query_term_parse(str, sep - str);
+		if (!term)
+		{
+			query_unref(q);
+			return NULL;
+		}
+		q->terms = g_list_append(q->terms, term);
+		if (!*sep) break;
+		str = sep + 1;
+	}
+
+	return q;
+}
+
+Query * query_ref(Query *q)
+{
+	__sync_fetch_and_add(&q->ref, 1);
+	return q;
+}
+
+void query_unref(Query *q)
+{
+	GList *l;
+
+	if (__sync_sub_and_fetch(&q->ref, 1))
+		return;
+	for (l = q->terms; l; l = l->next)
+		query_term_free(l->data);
+	g_list_free(q->terms);
+	free(q);
+}
+
+/**
+ * Check whether a file with @caps matches every term of the query
+ */
+int query_match(Query *q, GList *caps)
+{
+	GList *l;
+
+	for (l = q->terms; l; l = l->next)
+	{
+		QueryTerm *term = l->data;
+		GList *c;
+		int found = 0;
+
+		for (c = term->caps; c && !found; c = c->next)
+			found = g_list_find(caps, c->data) != NULL;
+		if (found == term->negate)
+			return 0;
+	}
+
+	return 1;
+}
+
+/**
+ * Get the canonical form of the query, the same set of terms written in
+ * any order gives the same string. The string must be freed with g_free()
+ */
+char * query_key(Query *q)
+{
+	GString *key;
+	GList *keys = NULL;
+	GList *l;
+
+	for (l = q->terms; l; l = l->next)
+	{
+		QueryTerm *term = l->data;
+		GString *s;
+
+		s = g_string_new(term->negate ? "-" : "+");
+		query_term_ids(s, term);
+		keys = g_list_insert_sorted(keys, g_string_free(s, FALSE),
+				query_key_cmp);
+	}
+	key = g_string_new("");
+	for (l = keys; l; l = l->next)
+	{
+		/* the same term twice is still the same query */
+		if (l->prev && !strcmp(l->prev->data, l->data))
+			continue;
+		g_string_append_printf(key, "%s%s", key->len ? ";" : "",
+				(char *)l->data);
+	}
+	for (l = keys; l; l = l->next)
+		g_free(l->data);
+	g_list_free(keys);
+
+	return g_string_free(key, FALSE);
+}
+
+/**
+ * Compile the query plus the caps every file must have into a single
+ * compound select of file ids. The positive terms are intersected, each
+ * one being an indexed lookup on filecaps, and the negated ones are
+ * removed from it. The string must be freed with sqlite3_free()
+ */
+char * query_to_sql(Query *q, GList *caps)
+{
+	GString *sql;
+	GList *l;
+	char *ret;
+	int positive = 0;
+
+	sql = g_string_new("");
+	for (l = caps; l; l = l->next)
+	{
+		Cap *cap = l->data;
+
+		g_string_append_printf(sql, "%sSELECT file FROM filecaps WHERE cap = %u",
+				positive++ ? " INTERSECT " : "", cap->id);
+	}
+	for (l = q->terms; l; l = l->next)
+	{
+		QueryTerm *term = l->data;
+
+		if (term->negate) continue;
+		g_string_append_printf(sql, "%sSELECT file FROM filecaps WHERE cap IN (",
+				positive++ ? " INTERSECT " : "");
+		query_term_ids(sql, term);
+		g_string_append(sql, ")");
+	}
+	/* only negated terms, remove them from every file */
+	if (!positive)
+		g_string_append(sql, "SELECT id FROM files");
+	for (l = q->terms; l; l = l->next)
+	{
+		QueryTerm *term = l->data;
+
+		if (!term->negate) continue;
+		g_string_append(sql, " EXCEPT SELECT file FROM filecaps WHERE cap IN (");
+		query_term_ids(sql, term);
+		g_string_append(sql, ")");
+	}
+	ret = sqlite3_mprintf("%s", sql->str);
+	g_string_free(sql, TRUE);
+
+	return ret;
+}
@@ -0,0 +1,871 @@
+#ifdef HAVE_CONFIG_H
+#include "config.h"
+#endif
+
+#include <stdlib.h>
+#include <string.h>
+#include <stdio.h>
+#include <stdint.h>
+#include <limits.h>
+#include <errno.h>
+#include <time.h>
+#include <dirent.h>
+#include <sys/stat.h>
+#include <pthread.h>
+#include <glib.h>
+#include <sqlite3.h>
+#include <gst/gst.h>
+#include "dmxfs.h"
+/*============================================================================*
+ *                                  Local                                     *
+ *============================================================================*/
+/* seconds without probing anything before the pipelines are dropped */
+#define DMXFS_GST_IDLE_TIMEOUT 30
+/* files marked or removed on every statement of the collector */
+#define DMXFS_GC_BATCH 256
+
+/* one pipeline finds the type of a file and the other decodes its streams */
+struct _ScanPipelines
+{
+	struct {
+		GstElement *pipeline;
+		GstElement *source;
+		GstElement *typefind;
+		GstElement *fakesink;
+	} typefind;
+	struct {
+		GstPipeline *pipeline;
+		GstElement *src;
+		GstElement *decodebin2;
+		GstElement *fakesink;
+	} uridecode;
+};
+
+static void setup_typefind_pipeline(dmxfs_scanner *s)
+{
+	GstElement *pipeline;
+	GstElement *source;
+	GstElement *typefind;
+	GstElement *fakesink;
+	
+	pipeline = gst_pipeline_new ("pipeline");
+	source = gst_element_factory_make ("filesrc", "source");
+	typefind = gst_element_factory_make ("typefind", "typefind");
+	fakesink = gst_element_factory_make ("fakesink", "fakesink");
+
+	gst_bin_add_many (GST_BIN (pipeline), source, typefind, fakesink, NULL);
+	gst_element_link_many (source, typefind, fakesink, NULL);
+
+	s->pipelines->typefind.pipeline = pipeline;
+	s->pipelines->typefind.source = source;
+	s->pipelines->typefind.typefind = typefind;
+	s->pipelines->typefind.fakesink = fakesink;
+}
+
+static void cleanup_typefind_pipeline(dmxfs_scanner *s)
+{
+	gst_object_unref (s->pipelines->typefind.pipeline);
+	s->pipelines->typefind.pipeline = NULL; 
+	s->pipelines->typefind.source = NULL;
+	s->pipelines->typefind.typefind = NULL;
+	s->pipelines->typefind.fakesink = NULL;
+}
+
+static void on_have_type (GstElement * typefind, guint probability,
+    const GstCaps * caps, GstCaps ** p_caps)
+{
+	if (p_caps) {
+		*p_caps = gst_caps_copy (caps);
+	}
+}
+
+/* whether the type of @file is a media one */
+static int is_media(dmxfs_scanner *s, char *file)
+{
+	GstCaps *caps = NULL;
+	GstState state;
+	GstStateChangeReturn sret;
+	int ret = 0;
+	gulong handler;
+	uint64_t span;
+
+	handler = g_signal_connect (G_OBJECT (s->pipelines->typefind.typefind), "have-type",
+			G_CALLBACK (on_have_type), &caps);
+
+	g_object_set (s->pipelines->typefind.source, "location", file, NULL);
+
+	span = trace_begin();
+	gst_element_set_state (GST_ELEMENT (s->pipelines->typefind.pipeline), GST_STATE_PAUSED);
+	sret = gst_element_get_state (GST_ELEMENT (s->pipelines->typefind.pipeline), &state, NULL, -1);
+	trace_end(LOG_GST, "typefind_paused", span);
+
+	switch (sret)
+	{
+		case GST_STATE_CHANGE_FAILURE:
+		break;
+
+		case GST_STATE_CHANGE_SUCCESS:
+		if (caps)
+		{
+			guint num;
+			guint i;
+
+			num = gst_caps_get_size(caps);
+			for (i = 0; i < num; i++)
+			{
+				GstStructure *st;
+				const gchar *name;
+
+				st = gst_caps_get_structure(caps, i);
+				name = gst_structure_get_name(st);
+				/* check that we have a valid caps first */
+				if (!strncmp(name, "video", 5) || !strncmp(name, "audio", 5)
+						|| !strncmp(name, "application/ogg", 15)
+						|| !strncmp(name, "application/x-id3", 17))
+				{
+					DMXFS_DBG(LOG_GST, "Caps found %s", name);
+					ret = 1;
+					break;
+				}
+			}
+		}
+		break;
+
+		default:
+		break;
+	}
+	if (caps)
+		gst_caps_unref (caps);
+	g_signal_handler_disconnect(G_OBJECT (s->pipelines->typefind.typefind), handler);
+	span = trace_begin();
+	gst_element_set_state (s->pipelines->typefind.pipeline, GST_STATE_NULL);
+	trace_end(LOG_GST, "typefind_null", span);
+
+	return ret;
+}
+
+static void setup_uridecode_pipeline(dmxfs_scanner *s)
+{
+	GstPipeline *pipeline;
+	GstElement *src;
+	GstElement *decodebin2;
+	GstElement *fakesink;
+
+	pipeline = GST_PIPELINE(gst_pipeline_new(NULL));
+	src = gst_element_factory_make("filesrc", NULL);
+	decodebin2 = gst_element_factory_make("decodebin2", NULL);
+	fakesink = gst_element_factory_make("fakesink", NULL);
+
+	gst_bin_add_many(GST_BIN(pipeline), src, decodebin2, NULL);
+	gst_element_link(src, decodebin2);
+	//gst_bin_add_many(GST_BIN(pipeline), src, decodebin2, fakesink, NULL);
+	//gst_element_link_many(src, decodebin2, fakesink, NULL);
+
+	s->pipelines->uridecode.pipeline = pipeline;
+	s->pipelines->uridecode.src = src;
+	s->pipelines->uridecode.decodebin2 = decodebin2;
+	s->pipelines->uridecode.fakesink = fakesink;
+}
+
+static void cleanup_uridecode_pipeline(dmxfs_scanner *s)
+{
+	gst_object_unref(s->pipelines->uridecode.pipeline);
+	s->pipelines->uridecode.pipeline = NULL;
+	s->pipelines->uridecode.src = NULL;
+	s->pipelines->uridecode.decodebin2 = NULL;
+	s->pipelines->uridecode.fakesink = NULL;
+}
+
+static gboolean on_autoplug_continue(GstBin *bin, GstPad *pad, GstCaps *caps,
+			gpointer user_data)
+{
+	GList **list = (GList **)user_data;
+	GstStructure *st;
+	const gchar *name;
+	int num;
+	int i;
+
+	num = gst_caps_get_size(caps);
+	for (i = 0; i < num; i++)
+	{
+		st = gst_caps_get_structure(caps, 0);
+		name = gst_structure_get_name(st);
+		if (strstr(name, "raw"))
+			return TRUE;
+	}
+	
+	*list = g_list_append(*list, gst_caps_ref(caps));
+	return TRUE;
+}
+
+/* The kernel keeps the entries and attributes for a long time, so every
+ * directory that might list the file, the entries for the file and its
+ * caps and the file itself must be invalidated whenever the file is added,
+ * removed or probed again
+ */
+static void scan_invalidate(dmxfs *mfs, unsigned int file_id, GList *caps)
+{
+	if (!mfs->invalidate) return;
+
+	node_invalidate(caps, file_id, mfs->invalidate, mfs);
+	mfs->invalidate(node_ino_from_file(file_id), NULL, mfs);
+}
+
+/* Write the file @info with its caps and stream information on a single
+ * transaction, so the readers never find it half indexed. Returns the id
+ * of the file or -1 when the transaction failed
+ */
+static int store_file(dmxfs_scanner *s, File *info, GList *caps)
+{
+	sqlite3 *db = dmxfs_db(s->mfs);
+	GList *old = NULL;
+	GList *l;
+	uint64_t span;
+	int id;
+
+	span = trace_begin();
+	if (sqlite3_exec(db, "BEGIN IMMEDIATE;", NULL, NULL, NULL) != SQLITE_OK)
+	{
+		DMXFS_ERR(LOG_DB, "could not begin the transaction of %s: %s",
+				info->name, sqlite3_errmsg(db));
+		id = -1;
+		goto end;
+	}
+	id = db_insert_file(db, info->name, info->modtime, info->size,
+			s->root->id);
+	if (id <= 0)
+	{
+		sqlite3_exec(db, "ROLLBACK;", NULL, NULL, NULL);
+		goto end;
+	}
+	/* a file probed again might have lost some of its caps */
+	old = cap_get_from_file(db, id);
+	db_delete_filecaps(db, id);
+	for (l = caps; l; l = l->next)
+	{
+		Cap *cap = l->data;
+
+		db_insert_filecap(db, id, cap->id);
+	}
+	file_set_media_info(db, id, info->duration, info->bitrate,
+			info->width, info->height);
+	if (sqlite3_exec(db, "COMMIT;", NULL, NULL, NULL) != SQLITE_OK)
+	{
+		DMXFS_ERR(LOG_DB, "could not commit %s: %s", info->name,
+				sqlite3_errmsg(db));
+		sqlite3_exec(db, "ROLLBACK;", NULL, NULL, NULL);
+		id = -1;
+	}
+end:
+	trace_end(LOG_DB, "insert_file", span);
+	if (id <= 0)
+	{
+		/* the file is not marked, the sweep must not remove it */
+		s->errors++;
+		g_list_free(old);
+		return id;
+	}
+
+	/* the triggers already updated the counters, copy them before
+	 * the kernel asks again for the attributes
+	 */
+	file_counters_load(db);
+	cap_counters_add(old, -1);
+	cap_counters_add(caps, 1);
+	/* the file is on the index now, the cached views are stale */
+	index_generation_bump();
+	scan_invalidate(s->mfs, id, caps);
+	/* the directories of the caps it lost do not list it anymore */
+	if (old)
+	{
+		scan_invalidate(s->mfs, id, old);
+		g_list_free(old);
+	}
+
+	return id;
+}
+
+/* decode the streams of @file and index it with the caps found, returns
+ * the id of the file
+ */
+static int get_caps(dmxfs_scanner *s, char *file, time_t mtime, off_t size)
+{
+	File info;
+	GstFormat format = GST_FORMAT_TIME;
+	gint64 duration = 0;
+	unsigned int bitrate = 0;
+	int width = 0;
+	int height = 0;
+	GstState state;
+	GstClockTime clock;
+	GstStateChangeReturn sret;
+	GList *caps = NULL;
+	GList *file_caps = NULL;
+	GList *tmp;
+	guint num;
+	int id;
+	guint i;
+	gulong handler;
+	uint64_t span;
+
+	g_object_set(G_OBJECT(s->pipelines->uridecode.src), "location", file, NULL);
+	handler = g_signal_connect(G_OBJECT(s->pipelines->uridecode.decodebin2), "autoplug-continue",
+			G_CALLBACK(on_autoplug_continue), &caps);
+	span = trace_begin();
+	gst_element_set_state(GST_ELEMENT(s->pipelines->uridecode.pipeline), GST_STATE_PLAYING);
+
+	/* wait until state change either completes or fails */
+	DMXFS_DBG(LOG_GST, "before changing state");
+	//sret = gst_element_get_state(GST_ELEMENT(s->pipelines->uridecode.pipeline), &state, NULL, -1);
+	clock = (GstClockTime)3 * GST_SECOND;
+	sret = gst_element_get_state(GST_ELEMENT(s->pipelines->uridecode.pipeline), &state, NULL, clock);
+	trace_end(LOG_GST, "decodebin_playing", span);
+	DMXFS_DBG(LOG_GST, "after changing state %d", sret);
+	switch (sret) {
+		case GST_STATE_CHANGE_FAILURE:
+		break;
+
+		case GST_STATE_CHANGE_SUCCESS:
+		tmp = caps;
+		while (tmp)
+		{
+			GstCaps *cap = tmp->data;
+			num = gst_caps_get_size(cap);
+			for (i = 0; i < num; i++)
+			{
+				GstStructure *st;
+				Cap *mcap;
+				const gchar *name;
+				char *tmp1;
+				char *tmp2;
+
+				st = gst_caps_get_structure(cap, i);
+				name = gst_structure_get_name(st);
+				/* keep the biggest resolution found */
+				if (!strncmp(name, "video", 5))
+				{
+					int w, h;
+
+					if (gst_structure_get_int(st, "width", &w) &&
+							gst_structure_get_int(st, "height", &h) &&
+							w * h > width * height)
+					{
+						width = w;
+						height = h;
+					}
+				}
+				/* replace the slashes with underscores */
+				tmp1 = strdup(name);
+				for (tmp2 = tmp1; tmp2 && *tmp2; tmp2++)
+				{
+					if (*tmp2 == '/') *tmp2 = '_';
+				}
+				mcap = cap_new_from_name(dmxfs_db(s->mfs), tmp1);
+				DMXFS_DBG(LOG_SCAN, "2 Adding cap %s", tmp1);
+				free(tmp1);
+				if (!mcap) continue;
+				if (!g_list_find(file_caps, mcap))
+					file_caps = g_list_append(file_caps, mcap);
+			}
+			gst_caps_unref(cap);
+			tmp = tmp->next;
+		}
+		/* now the stream information */
+		if (!gst_element_query_duration(GST_ELEMENT(s->pipelines->uridecode.pipeline),
+				&format, &duration) || duration < 0)
+			duration = 0;
+		duration /= GST_MSECOND;
+		if (duration)
+			bitrate = (size * 8 * 1000) / duration;
+		break;
+
+		default:
+		break;
+	}
+	g_signal_handler_disconnect(G_OBJECT (s->pipelines->uridecode.decodebin2), handler);
+	span = trace_begin();
+	gst_element_set_state(GST_ELEMENT(s->pipelines->uridecode.pipeline), GST_STATE_NULL);
+	trace_end(LOG_GST, "decodebin_null", span);
+	/* a media file whose streams could not be decoded is kept anyway */
+	memset(&info, 0, sizeof(info));
+	info.name = file;
+	info.modtime = mtime;
+	info.size = size;
+	info.duration = duration;
+	info.bitrate = bitrate;
+	info.width = width;
+	info.height = height;
+	id = store_file(s, &info, file_caps);
+	g_list_free(caps);
+	if (file_caps)
+		g_list_free(file_caps);
+
+	return id;
+}
+
+/* Loading the plugin registry takes long and a lot of memory, so it is
+ * only done once a file needs to be probed. The registry can not be
+ * unloaded afterwards, but the pipelines and the plugins they hold are
+ * dropped once idle
+ */
+static pthread_once_t _gst_once = PTHREAD_ONCE_INIT;
+
+static void _gst_init(void)
+{
+	uint64_t start = scan_now();
+
+	gst_init(0, NULL);
+	DMXFS_INFO(LOG_GST, "gstreamer loaded in %.3f secs",
+			(scan_now() - start) / 1e9);
+}
+
+/* Remove the files matching @cond, at most DMXFS_GC_BATCH of them, on a
+ * transaction of their own. Returns the number of files removed
+ */
+static unsigned int scan_sweep_batch(dmxfs *mfs, sqlite3 *db,
+		const char *cond)
+{
+	sqlite3_stmt *stmt;
+	const char *tail;
+	GArray *ids;
+	GList **caps;
+	GString *list;
+	char *str;
+	unsigned int count;
+	unsigned int i;
+	int error;
+
+	str = sqlite3_mprintf("SELECT id FROM files WHERE %s LIMIT %d;", cond,
+			DMXFS_GC_BATCH);
+	error = sqlite3_prepare(db, str, -1, &stmt, &tail);
+	sqlite3_free(str);
+	if (error != SQLITE_OK)
+	{
+		DMXFS_ERR(LOG_DB, "Error looking for the files to remove: %s", sqlite3_errmsg(db));
+		return 0;
+	}
+	ids = g_array_new(FALSE, FALSE, sizeof(unsigned int));
+	while (sqlite3_step(stmt) == SQLITE_ROW)
+	{
+		unsigned int id = sqlite3_column_int(stmt, 0);
+
+		g_array_append_val(ids, id);
+	}
+	sqlite3_finalize(stmt);
+	count = ids->len;
+	if (!count)
+	{
+		g_array_free(ids, TRUE);
+		return 0;
+	}
+
+	/* the directories that list them are invalidated once removed */
+	caps = calloc(count, sizeof(GList *));
+	list = g_string_new("");
+	for (i = 0; i < count; i++)
+	{
+		unsigned int id = g_array_index(ids, unsigned int, i);
+
+		caps[i] = cap_get_from_file(db, id);
+		g_string_append_printf(list, "%s%u", i ? "," : "", id);
+	}
+	str = sqlite3_mprintf("BEGIN IMMEDIATE;"
+			"DELETE FROM filecaps WHERE file IN (%s);"
+			"DELETE FROM files WHERE id IN (%s);"
+			"COMMIT;", list->str, list->str);
+	error = sqlite3_exec(db, str, NULL, NULL, NULL);
+	sqlite3_free(str);
+	g_string_free(list, TRUE);
+	if (error != SQLITE_OK)
+	{
+		DMXFS_ERR(LOG_DB, "Error removing the files: %s", sqlite3_errmsg(db));
+		sqlite3_exec(db, "ROLLBACK;", NULL, NULL, NULL);
+		count = 0;
+	}
+	else
+	{
+		file_counters_load(db);
+		for (i = 0; i < count; i++)
+			cap_counters_add(caps[i], -1);
+		index_generation_bump();
+	}
+	for (i = 0; i < count; i++)
+		scan_invalidate(mfs, g_array_index(ids, unsigned int, i), caps[i]);
+	for (i = 0; i < ids->len; i++)
+		g_list_free(caps[i]);
+	free(caps);
+	g_array_free(ids, TRUE);
+
+	return count;
+}
+
+/* the files found by the scan are marked on batches */
+static void scan_mark_flush(dmxfs_scanner *s)
+{
+	GString *list;
+	char *str;
+	unsigned int i;
+
+	if (!s->seen || !s->seen->len)
+		return;
+	list = g_string_new("");
+	for (i = 0; i < s->seen->len; i++)
+		g_string_append_printf(list, "%s%d", i ? "," : "",
+				g_array_index(s->seen, int, i));
+	/* the files indexed before the roots are adopted by the root */
+	str = sqlite3_mprintf("UPDATE files SET seen = %u, root = %u WHERE id IN (%s);",
+			s->generation, s->root->id, list->str);
+	if (sqlite3_exec(dmxfs_db(s->mfs), str, NULL, NULL, NULL) != SQLITE_OK)
+	{
+		/* they would be removed otherwise */
+		DMXFS_ERR(LOG_DB, "could not mark the files: %s",
+				sqlite3_errmsg(dmxfs_db(s->mfs)));
+		s->errors++;
+	}
+	sqlite3_free(str);
+	g_string_free(list, TRUE);
+	g_array_set_size(s->seen, 0);
+}
+
+static void scan_mark(dmxfs_scanner *s, int id)
+{
+	/* nothing is collected when building an index */
+	if (!s->seen || id <= 0)
+		return;
+	g_array_append_val(s->seen, id);
+	if (s->seen->len >= DMXFS_GC_BATCH)
+		scan_mark_flush(s);
+}
+
+/* Remove the files of the root the scan did not mark. The files indexed
+ * before the roots are found by their path, the ones still there were
+ * adopted by the marks
+ */
+static void scan_sweep(dmxfs_scanner *s)
+{
+	sqlite3 *db = dmxfs_db(s->mfs);
+	const char *path = s->root->path;
+	char *cond[2];
+	char *str;
+	unsigned int n;
+	uint64_t span;
+	int i;
+
+	if (s->errors || !root_reachable(path))
+	{
+		DMXFS_WARN(LOG_SCAN, "the scan of %s is not complete, the files "
+				"not found are kept", path);
+		return;
+	}
+	span = trace_begin();
+	cond[0] = sqlite3_mprintf("root = %u AND seen < %u", s->root->id,
+			s->generation);
+	cond[1] = sqlite3_mprintf("root = 0 AND file >= '%q/' AND file < '%q0'",
+			path, path);
+	for (i = 0; i < 2; i++)
+	{
+		while ((n = scan_sweep_batch(s->mfs, db, cond[i])))
+			s->stats.removed += n;
+		sqlite3_free(cond[i]);
+	}
+	str = sqlite3_mprintf("UPDATE roots SET generation = %u WHERE id = %u;",
+			s->generation, s->root->id);
+	if (sqlite3_exec(db, str, NULL, NULL, NULL) == SQLITE_OK)
+		s->root->generation = s->generation;
+	sqlite3_free(str);
+	trace_end(LOG_SCAN, "sweep", span);
+	if (s->stats.removed)
+		DMXFS_INFO(LOG_SCAN, "%u files of %s are gone", s->stats.removed,
+				path);
+}
+
+/* Once every root is scanned, remove the caps no file has anymore and give
+ * back the pages of the removed rows
+ */
+static void scan_collect(dmxfs *mfs)
+{
+	sqlite3 *db = dmxfs_db(mfs);
+	sqlite3_stmt *stmt;
+	const char *tail;
+	GList *caps = NULL;
+	GList *l;
+	unsigned int removed = 0;
+	uint64_t span;
+
+	span = trace_begin();
+	if (sqlite3_prepare(db, "SELECT id FROM caps WHERE files <= 0;", -1,
+			&stmt, &tail) != SQLITE_OK)
+		return;
+	while (sqlite3_step(stmt) == SQLITE_ROW)
+	{
+		Cap *cap;
+
+		cap = cap_get_from_id(sqlite3_column_int(stmt, 0));
+		if (cap)
+			caps = g_list_append(caps, cap);
+	}
+	sqlite3_finalize(stmt);
+	for (l = caps; l; l = l->next)
+	{
+		Cap *cap = l->data;
+
+		if (!cap_destroy(cap, db))
+			continue;
+		removed++;
+		if (mfs->invalidate)
+			mfs->invalidate(NODE_INO_ROOT, cap->name, mfs);
+	}
+	g_list_free(caps);
+	if (removed)
+	{
+		DMXFS_INFO(LOG_SCAN, "%u caps no file has are removed", removed);
+		index_generation_bump();
+		/* the number of links of the root */
+		if (mfs->invalidate)
+			mfs->invalidate(NODE_INO_ROOT, NULL, mfs);
+	}
+	db_vacuum(db);
+	trace_end(LOG_DB, "collect", span);
+}
+
+static void * _scanner(void *data)
+{
+	dmxfs_scanner *s = data;
+	dmxfs *mfs = s->mfs;
+
+	/* the generation is only stored once the scan is complete */
+	s->generation = s->root->generation + 1;
+	scan_dir(s, s->root->path);
+	/* nothing else to probe until the next scan */
+	scan_pipelines_put(s, 1);
+	/* an interrupted walk did not see every file, none can be removed */
+	if (__atomic_load_n(&s->stop, __ATOMIC_ACQUIRE))
+	{
+		DMXFS_INFO(LOG_SCAN, "the scan of %s is stopped", s->root->path);
+		__atomic_sub_fetch(&mfs->scanning, 1, __ATOMIC_ACQ_REL);
+		return NULL;
+	}
+	scan_mark_flush(s);
+	scan_sweep(s);
+	DMXFS_INFO(LOG_SCAN, "the root %s is scanned", s->root->path);
+	if (!__atomic_sub_fetch(&mfs->scanning, 1, __ATOMIC_ACQ_REL))
+		scan_collect(mfs);
+	return NULL;
+}
+/*============================================================================*
+ *                                 Global                                     *
+ *============================================================================*/
+uint64_t scan_now(void)
+{
+	struct timespec ts;
+
+	clock_gettime(CLOCK_MONOTONIC, &ts);
+	return (uint64_t)ts.tv_sec * 1000000000ULL + ts.tv_nsec;
+}
+
+void scan_pipelines_get(dmxfs_scanner *s)
+{
+	if (!s->pipelines)
+	{
+		pthread_once(&_gst_once, _gst_init);
+		s->pipelines = calloc(1, sizeof(ScanPipelines));
+		setup_typefind_pipeline(s);
+		setup_uridecode_pipeline(s);
+	}
+	s->gst_used = scan_now();
+}
+
+/* drop the pipelines when unused for a while, or right away with @force */
+void scan_pipelines_put(dmxfs_scanner *s, int force)
+{
+	if (!s->pipelines)
+		return;
+	if (!force && scan_now() - s->gst_used <
+			(uint64_t)DMXFS_GST_IDLE_TIMEOUT * 1000000000ULL)
+		return;
+	DMXFS_DBG(LOG_GST, "dropping the idle pipelines");
+	cleanup_typefind_pipeline(s);
+	cleanup_uridecode_pipeline(s);
+	free(s->pipelines);
+	s->pipelines = NULL;
+}
+
+/* Index the file if it is new or changed since the last scan. The time
+ * from @start is accounted as walking, returns when the file was done
+ */
+uint64_t scan_file(dmxfs_scanner *s, char *file, time_t mtime, off_t size,
+		uint64_t start)
+{
+	dmxfs_scan_stats *stats = &s->stats;
+	uint64_t now;
+	int changed;
+	int media;
+	int id;
+
+	stats->files++;
+	now = scan_now();
+	stats->walk += now - start;
+	start = now;
+
+	DMXFS_DBG(LOG_SCAN, "processing file %s", file);
+	changed = db_file_changed(dmxfs_db(s->mfs), file, mtime, &id);
+	now = scan_now();
+	stats->check += now - start;
+	metrics_span(METRIC_SCAN_CHECK, start, now);
+	start = now;
+	if (!changed)
+	{
+		DMXFS_DBG(LOG_SCAN, "file didnt change, nothing to do");
+		scan_mark(s, id);
+		scan_pipelines_put(s, 0);
+		return now;
+	}
+	stats->probed++;
+	scan_pipelines_get(s);
+	media = is_media(s, file);
+	DMXFS_DBG(LOG_SCAN, "media found? %d", media);
+	now = scan_now();
+	stats->probe += now - start;
+	metrics_span(METRIC_SCAN_PROBE, start, now);
+	start = now;
+	if (media) {
+		stats->media++;
+		id = get_caps(s, file, mtime, size);
+		scan_mark(s, id);
+		now = scan_now();
+		stats->caps += now - start;
+		metrics_span(METRIC_SCAN_CAPS, start, now);
+	}
+
+	return now;
+}
+
+void scan_dir(dmxfs_scanner *s, const char *path)
+{
+	dmxfs_scan_stats *stats = &s->stats;
+	DIR *dp;
+	struct dirent *de;
+	uint64_t start;
+	uint64_t span;
+
+	DMXFS_DBG(LOG_SCAN, "scanning %s", path);
+	start = scan_now();
+	dp = opendir(path);
+	if (!dp)
+	{
+		DMXFS_WARN(LOG_SCAN, "cannot scan dir %s", path);
+		s->errors++;
+		return;
+	}
+	/* the whole directory, its subdirectories included */
+	span = trace_begin();
+	stats->dirs++;
+
+	while ((de = readdir(dp)) != NULL)
+	{
+		char realfile[PATH_MAX];
+		struct stat st;
+
+		if (__atomic_load_n(&s->stop, __ATOMIC_ACQUIRE))
+			break;
+		if (!strcmp(de->d_name, ".") || !strcmp(de->d_name, ".."))
+			continue;
+
+		/* also check subdirs */
+		strncpy(realfile, path, PATH_MAX);
+		strncat(realfile, "/", PATH_MAX - strlen(de->d_name));
+		strncat(realfile, de->d_name, PATH_MAX - strlen(de->d_name));
+
+		if (stat(realfile, &st) < 0)
+		{
+			DMXFS_WARN(LOG_SCAN, "err on stat %d %s", errno, realfile);
+			continue;
+		}
+
+		if (S_ISDIR(st.st_mode))
+		{
+			/* the subdirectory accounts its own time */
+			stats->walk += scan_now() - start;
+			scan_dir(s, realfile);
+			start = scan_now();
+		}
+		else if (S_ISREG(st.st_mode))
+		{
+			start = scan_file(s, realfile, st.st_mtime, st.st_size, start);
+		}
+	}
+	closedir(dp);
+	stats->walk += scan_now() - start;
+	trace_end(LOG_SCAN, "walk", span);
+}
+
+/* The roots are usually on different disks, so each one is scanned on its
+ * own thread. Their files are written to the same database, there are no
+ * shards, so only the probing runs in parallel, the writers wait for each
+ * other on BEGIN IMMEDIATE
+ */
+void dmxfs_scan(dmxfs *mfs)
+{
+	GList *l;
+	int ret;
+	pthread_attr_t attr;
+
+	ret = pthread_attr_init(&attr);
+	if (ret) {
+		DMXFS_ERR(LOG_SCAN, "pthread_attr_init: %s", strerror(ret));
+		return;
+	}
+
+	for (l = mfs->roots; l; l = l->next)
+	{
+		dmxfs_root *root = l->data;
+		dmxfs_scanner *s;
+
+		if (root->offline)
+			continue;
+		s = calloc(1, sizeof(dmxfs_scanner));
+		s->mfs = mfs;
+		s->root = root;
+		s->seen = g_array_new(FALSE, FALSE, sizeof(int));
+		__atomic_add_fetch(&mfs->scanning, 1, __ATOMIC_ACQ_REL);
+		ret = pthread_create(&s->thread, &attr, _scanner, s);
+		if (ret) {
+			DMXFS_ERR(LOG_SCAN, "pthread_create: %s", strerror(ret));
+			__atomic_sub_fetch(&mfs->scanning, 1, __ATOMIC_ACQ_REL);
+			g_array_free(s->seen, TRUE);
+			free(s);
+			continue;
+		}
+		mfs->scanners = g_list_append(mfs->scanners, s);
+	}
+	pthread_attr_destroy(&attr);
+}
+
+
+/* Stop every scanner and drop its pipelines. A scanner is never cancelled,
+ * it could be inside a transaction, it leaves the walk on the next entry
+ * and returns without touching the index again
+ */
+void dmxfs_scan_stop(dmxfs *mfs)
+{
+	GList *l;
+
+	for (l = mfs->scanners; l; l = l->next)
+	{
+		dmxfs_scanner *s = l->data;
+
+		__atomic_store_n(&s->stop, 1, __ATOMIC_RELEASE);
+	}
+	for (l = mfs->scanners; l; l = l->next)
+	{
+		dmxfs_scanner *s = l->data;
+
+		pthread_join(s->thread, NULL);
+		/* remove the pipelines */
+		scan_pipelines_put(s, 1);
+		g_array_free(s->seen, TRUE);
+		free(s);
+	}
+	g_list_free(mfs->scanners);
+	mfs->scanners = NULL;
+}
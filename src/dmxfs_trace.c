@@ -0,0 +1,230 @@
+#ifdef HAVE_CONFIG_H
+#include "config.h"
+#endif
+
+#include <stdlib.h>
+#include <string.h>
+#include <stdio.h>
+#include <stdint.h>
+#include <unistd.h>
+#include <pthread.h>
+#include <sys/syscall.h>
+#include <glib.h>
+#include <sqlite3.h>
+#include "dmxfs.h"
+/*============================================================================*
+ *                                  Local                                     *
+ *============================================================================*/
+/* Every thread keeps its last spans on a ring of its own, so recording one
+ * never waits for another thread. The lock of a ring is only contended
+ * while the timeline is being dumped
+ */
+typedef struct _TraceEvent
+{
+	const char *name;
+	LogCategory category;
+	pid_t tid;
+	uint64_t start;
+	uint64_t end;
+} TraceEvent;
+
+typedef struct _TraceThread
+{
+	struct _TraceThread *next;
+	struct _TraceThread *next_free;
+	pthread_mutex_t lock;
+	pid_t tid;
+	/* spans ever recorded, the last _size ones are kept */
+	uint64_t count;
+	TraceEvent events[];
+} TraceThread;
+
+static TraceThread *_threads = NULL;
+static TraceThread *_free = NULL;
+static unsigned int _size = 0;
+static pthread_mutex_t _lock = PTHREAD_MUTEX_INITIALIZER;
+static pthread_key_t _key;
+static __thread TraceThread *_thread = NULL;
+
+static void _thread_exit(void *data)
+{
+	TraceThread *t = data;
+
+	pthread_mutex_lock(&_lock);
+	t->next_free = _free;
+	_free = t;
+	pthread_mutex_unlock(&_lock);
+}
+
+static TraceThread * trace_thread(void)
+{
+	TraceThread *t;
+
+	if (_thread) return _thread;
+
+	pthread_mutex_lock(&_lock);
+	t = _free;
+	if (t)
+	{
+		/* the spans of the previous thread are kept with its tid */
+		_free = t->next_free;
+	}
+	else
+	{
+		t = calloc(1, sizeof(TraceThread) + _size * sizeof(TraceEvent));
+		pthread_mutex_init(&t->lock, NULL);
+		t->next = _threads;
+		_threads = t;
+	}
+	pthread_mutex_unlock(&_lock);
+	t->tid = syscall(SYS_gettid);
+	pthread_setspecific(_key, t);
+	_thread = t;
+
+	return t;
+}
+
+static void trace_event_print(GString *s, TraceEvent *ev, pid_t pid)
+{
+	g_string_append_printf(s, "{\"name\":\"%s\",\"cat\":\"%s\",\"ph\":\"X\","
+			"\"ts\":%llu.%03u,\"dur\":%llu.%03u,\"pid\":%d,\"tid\":%d}",
+			ev->name, log_category_name(ev->category),
+			(unsigned long long)(ev->start / 1000),
+			(unsigned int)(ev->start % 1000),
+			(unsigned long long)((ev->end - ev->start) / 1000),
+			(unsigned int)((ev->end - ev->start) % 1000),
+			pid, ev->tid);
+}
+/*============================================================================*
+ *                                 Global                                     *
+ *============================================================================*/
+int trace_enabled = 0;
+
+/**
+ * Start recording the spans, keeping the last @events of every thread
+ */
+int trace_init(unsigned int events)
+{
+	if (!events || pthread_key_create(&_key, _thread_exit))
+		return 0;
+	_size = events;
+	__atomic_store_n(&trace_enabled, 1, __ATOMIC_RELEASE);
+
+	return 1;
+}
+
+/**
+ * Start a span, the returned value must be passed to trace_end()
+ */
+uint64_t trace_begin(void)
+{
+	if (!trace_enabled) return 0;
+	return metrics_now();
+}
+
+void trace_end(LogCategory category, const char *name, uint64_t start)
+{
+	if (!start) return;
+	trace_span(category, name, start, metrics_now());
+}
+
+/**
+ * Record a span from @start to @end, both as returned by metrics_now().
+ * The @name must be a static string
+ */
+void trace_span(LogCategory category, const char *name, uint64_t start,
+		uint64_t end)
+{
+	TraceThread *t;
+	TraceEvent *ev;
+
+	if (!trace_enabled) return;
+
+	t = trace_thread();
+	pthread_mutex_lock(&t->lock);
+	ev = &t->events[t->count % _size];
+	ev->name = name;
+	ev->category = category;
+	ev->tid = t->tid;
+	ev->start = start;
+	ev->end = end;
+	t->count++;
+	pthread_mutex_unlock(&t->lock);
+}
+
+/**
+ * The spans kept on the Chrome trace event format, as loaded by Perfetto or
+ * chrome://tracing. The returned string must be freed with g_free()
+ */
+char * trace_dump(void)
+{
+	TraceThread *t;
+	GString *s;
+	pid_t pid;
+	int first = 1;
+
+	pid = getpid();
+	s = g_string_new("{\"displayTimeUnit\":\"ns\",\"traceEvents\":[");
+	pthread_mutex_lock(&_lock);
+	for (t = _threads; t; t = t->next)
+	{
+		uint64_t i;
+
+		pthread_mutex_lock(&t->lock);
+		i = t->count > _size ? t->count - _size : 0;
+		for (; i < t->count; i++)
+		{
+			if (!first) g_string_append_c(s, ',');
+			g_string_append_c(s, '\n');
+			trace_event_print(s, &t->events[i % _size], pid);
+			first = 0;
+		}
+		pthread_mutex_unlock(&t->lock);
+	}
+	pthread_mutex_unlock(&_lock);
+	g_string_append(s, "\n]}\n");
+
+	return g_string_free(s, FALSE);
+}
+
+int trace_write(const char *path)
+{
+	FILE *f;
+	char *str;
+	int ret;
+
+	f = fopen(path, "w");
+	if (!f) return 0;
+	str = trace_dump();
+	ret = fputs(str, f) >= 0;
+	g_free(str);
+	if (fclose(f)) ret = 0;
+
+	return ret;
+}
+
+/**
+ * Free every ring, only once the rest of threads are gone
+ */
+void trace_shutdown(void)
+{
+	TraceThread *t;
+
+	if (!trace_enabled) return;
+	trace_enabled = 0;
+	_thread = NULL;
+	pthread_mutex_lock(&_lock);
+	t = _threads;
+	_threads = NULL;
+	_free = NULL;
+	pthread_mutex_unlock(&_lock);
+	while (t)
+	{
+		TraceThread *next = t->next;
+
+		pthread_mutex_destroy(&t->lock);
+		free(t);
+		t = next;
+	}
+	pthread_key_delete(_key);
+}